@@ -0,0 +1,212 @@
+#! /usr/bin/perl
+#
+# Time vmdktool against synthetic disk images and print one JSON object per
+# measurement.  The images are generated deterministically so that numbers
+# from different builds can be compared.
+#
+# Tunables (environment):
+#   BENCH_SIZES  Image sizes in MB (default "16 64")
+#   BENCH_Z      Deflate strengths for -v (default "1 6 9")
+#   BENCH_J      Thread counts for -v, -r and -C (default "1")
+#   BENCH_G      Grain sizes for -v, read back by -r, -s, -i and -C
+#                (default "64k")
+#   BENCH_SETS   Images to use (default "zero random text sparse uneven")
+#   BENCH_RUNS   Runs per measurement; the fastest is reported (default 3)
+#   BENCH_DIR    Scratch directory (default bench/data)
+#
+# Peak RSS is taken from time(1) and system call counts from strace(1) or
+# truss(1) when they're available, otherwise they're reported as null.
+
+use strict;
+use warnings;
+use Fcntl qw(O_CREAT O_TRUNC O_WRONLY SEEK_SET);
+use File::Path qw(mkpath rmtree);
+use Time::HiRes qw(time);
+
+use constant PROG => 'vmdktool';
+use constant GRAIN => 65536;
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+my $d = $ENV{BENCH_DIR} || "bench/data";
+my @sizes = split ' ', $ENV{BENCH_SIZES} || "16 64";
+my @zs = split ' ', $ENV{BENCH_Z} || "1 6 9";
+my @js = split ' ', $ENV{BENCH_J} || "1";
+my @gs = split ' ', $ENV{BENCH_G} || "64k";
+my @sets = split ' ', $ENV{BENCH_SETS} || "zero random text sparse uneven";
+my $runs = $ENV{BENCH_RUNS} || 3;
+
+-x $cmd or die "$cmd: Not built\n";
+
+my ($timecmd, $tracecmd);
+if (system("/usr/bin/time -f %M true >/dev/null 2>&1") == 0) {
+    $timecmd = '/usr/bin/time -f "RSS %M"';		# GNU, kB
+} elsif (system("/usr/bin/time -l true >/dev/null 2>&1") == 0) {
+    $timecmd = '/usr/bin/time -l';			# BSD, kB or bytes
+}
+if (system("strace -V >/dev/null 2>&1") == 0) {
+    $tracecmd = 'strace -f -c -o';
+} elsif (system("which truss >/dev/null 2>&1") == 0) {
+    $tracecmd = 'truss -f -c -o';
+}
+
+# A deterministic byte stream; the middle bits of the classic rand() LCG
+my $seed = 1;
+sub noise {
+    my ($n) = @_;
+    my $s = '';
+    for (1 .. $n) {
+	$seed = ($seed * 1103515245 + 12345) % 2147483648;
+	$s .= pack 'C', $seed >> 16 & 255;
+    }
+    return $s;
+}
+
+my @words = qw(the of and disk grain sector table marker vmdk raw stream
+    block inode file directory superblock cylinder partition boot loader
+    kernel module config etc usr local lib share bin);
+my $noise = noise(GRAIN);
+my $text = '';
+while (length $text < GRAIN) {
+    $seed = ($seed * 1103515245 + 12345) % 2147483648;
+    $text .= $words[($seed >> 16) % @words] .
+	(($seed >> 8) % 11 ? ' ' : "\n");
+}
+$text = substr $text, 0, GRAIN;
+
+# Each grain differs so that nothing can be shared between grains
+sub randomgrain { return $noise ^ pack('N', $_[0] * 2654435761 % 4294967296) x (GRAIN / 4) }
+sub textgrain { return substr("grain $_[0]\n" . $text, 0, GRAIN) }
+
+sub mkimage {
+    my ($set, $mb) = @_;
+    my $fn = "$d/$set-${mb}M.raw";
+    my $grains = $mb * 1048576 / GRAIN;
+
+    return $fn if -f $fn;
+    sysopen my $fd, $fn, O_CREAT | O_TRUNC | O_WRONLY or die "$fn: $!";
+    for my $g (0 .. $grains - 1) {
+	my $data;
+	if ($set eq 'zero') {
+	    $data = "\0" x GRAIN;
+	} elsif ($set eq 'random') {
+	    $data = randomgrain($g);
+	} elsif ($set eq 'text') {
+	    $data = textgrain($g);
+	} elsif ($set eq 'sparse') {
+	    # Mostly holes with a little of everything else
+	    next if $g % 8 > 1;
+	    $data = $g % 16 ? textgrain($g) : randomgrain($g);
+	    seek $fd, $g * GRAIN, SEEK_SET;
+	} elsif ($set eq 'uneven') {
+	    $data = $g % 2 ? textgrain($g) : randomgrain($g);
+	} else {
+	    die "$set: Unknown image type\n";
+	}
+	syswrite $fd, $data;
+    }
+    if ($set eq 'uneven') {
+	# Finish part way through a grain and a sector
+	syswrite $fd, substr(textgrain($grains), 0, 3 * 512 + 100);
+    } else {
+	truncate $fd, $grains * GRAIN;
+    }
+    close $fd or die "$fn: $!";
+    return $fn;
+}
+
+# Run a command $runs times, returning the best time and the peak RSS & system
+# call count from extra runs
+sub measure {
+    my ($args) = @_;
+    my ($best, $rss, $calls, $out);
+
+    for (1 .. $runs) {
+	my $t = time;
+	system("$cmd $args >/dev/null 2>&1") == 0 or die "$cmd $args: Failed\n";
+	$t = time - $t;
+	$best = $t if !defined $best || $t < $best;
+    }
+
+    if ($timecmd) {
+	$out = `$timecmd $cmd $args 2>&1 >/dev/null`;
+	if ($out =~ /^RSS (\d+)/m) {
+	    $rss = $1;
+	} elsif ($out =~ /(\d+)\s+maximum resident set size/) {
+	    # Bytes on macOS, kB on the BSDs
+	    $rss = $^O eq 'darwin' ? int($1 / 1024) : $1;
+	}
+    }
+
+    if ($tracecmd) {
+	my $log = "$d/trace.out";
+	system "$tracecmd $log $cmd $args >/dev/null 2>&1";
+	if (open my $fd, '<', $log) {
+	    while (<$fd>) {
+		# strace's "total" line, or truss's last line of counts
+		$calls = $1 if /^\s*[\d.]+\s+[\d.]+\s+\d+\s+(\d+)(?:\s+\d+)?\s+total$/;
+		$calls = $1 if !defined $calls && /^\s+[\d.]+\s+(\d+)\s+\d+\s*$/;
+	    }
+	}
+	unlink $log;
+    }
+
+    return ($best, $rss, $calls);
+}
+
+sub report {
+    my (%r) = @_;
+    my @k = qw(set size op g z j secs mbps ratio rss_kb syscalls);
+    print '{', join(', ', map {
+	my $v = $r{$_};
+	sprintf '"%s": %s', $_, !defined $v ? 'null' :
+	    $v =~ /^-?[\d.]+$/ ? $v : qq{"$v"}
+    } grep { exists $r{$_} } @k), "}\n";
+}
+
+rmtree $d;
+mkpath $d;
+
+for my $mb (@sizes) {
+    for my $set (@sets) {
+	my $raw = mkimage($set, $mb);
+	my $rawsz = -s $raw;
+	my $vmdk = "$d/$set-${mb}M.vmdk";
+	my $mbs = sub { sprintf '%.1f', $rawsz / 1048576 / $_[0] };
+
+	for my $g (@gs) {
+	    for my $z (@zs) {
+		for my $j (@js) {
+		    my $out = "$d/$set-${mb}M-g$g-z$z-j$j.vmdk";
+		    my ($t, $rss, $calls) =
+			measure("-g$g -j$j -z$z -v $out $raw");
+		    report(set => $set, size => $rawsz, op => '-v', g => $g,
+			z => $z, j => $j, secs => sprintf('%.3f', $t),
+			mbps => $mbs->($t),
+			ratio => sprintf('%.3f', $rawsz / (-s $out)),
+			rss_kb => $rss, syscalls => $calls);
+		    rename $out, $vmdk
+			if $z == $zs[$#zs / 2] && $j == $js[0];
+		    unlink $out;
+		}
+	    }
+
+	    for my $op ('-r', '-s', '-i', '-C') {
+		for my $j ($op eq '-r' || $op eq '-C' ? @js : 1) {
+		    my $out = "$d/$set-${mb}M.out";
+		    my $args = $op eq '-i' ? "-i $vmdk" :
+			$op eq '-C' ? "-j$j -C $vmdk" :
+			$op eq '-r' ? "-j$j -r $out $vmdk" : "$op $out $vmdk";
+		    my ($t, $rss, $calls) = measure($args);
+		    report(set => $set, size => $rawsz, op => $op, g => $g,
+			j => $j, secs => sprintf('%.3f', $t),
+			mbps => $mbs->($t), rss_kb => $rss, syscalls => $calls);
+		    unlink $out;
+		}
+	    }
+	}
+	unlink $raw, $vmdk;
+    }
+}
+
+rmtree $d;
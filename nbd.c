@@ -0,0 +1,593 @@
+/*-
+ * Copyright (c) 2026 The vmdktool authors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Each connection has a thread that does the fixed newstyle handshake and
+ * then reads requests, queueing reads for a pool of workers.  Workers
+ * read through libvmdk, so only the grains that are asked for are ever
+ * decompressed, and reply in whatever order they finish, as NBD allows.
+ */
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmdk.h"
+#include "nbd.h"
+
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_OPTMAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REPMAGIC		0x0003e889045565a9ULL
+#define NBD_REQMAGIC		0x25609513
+#define NBD_SIMPLEMAGIC		0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)	/* Handshake flags */
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+#define NBD_FLAG_C_NO_ZEROES	(1 << 1)	/* Client flags */
+
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)	/* Transmission flags */
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_REP_ERR_INVALID	0x80000003
+
+#define NBD_INFO_EXPORT		0
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+
+#define NBD_EPERM		1
+#define NBD_EIO			5
+#define NBD_ENOMEM		12
+#define NBD_EINVAL		22
+
+#define NBD_MAXOPT		4096		/* Longest option we accept */
+#define NBD_MAXREAD		(32 * 1024 * 1024) /* Longest read we serve */
+#define NBD_QUEUED		64		/* Requests queued per worker */
+
+struct nbdconn {
+	int		fd;
+	pthread_mutex_t	wlock;		/* Replies are written whole */
+	unsigned	pending;	/* Requests queued or being served */
+	struct nbdconn	*next;
+};
+
+struct nbdjob {
+	struct nbdconn	*c;
+	uint64_t	handle;
+	uint64_t	off;
+	uint32_t	len;
+	uint64_t	start;		/* When the request arrived */
+	struct nbdjob	*next;
+};
+
+struct nbdserver {
+	struct vmdk	*v;
+	pthread_mutex_t	lock;
+	pthread_cond_t	work;		/* A job was queued, or quitting */
+	pthread_cond_t	done;		/* A job or a connection finished */
+	struct nbdjob	*head, *tail;
+	unsigned	queued, maxqueued;
+	int		quit;
+	struct nbdconn	*conns;
+	unsigned	nconns;
+	struct nbdstats	*st;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+nbdstop(int sig __attribute__((__unused__)))
+{
+	stopping = 1;
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t
+get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static int
+readn(int fd, void *buf, size_t n)
+{
+	unsigned char *p;
+	ssize_t got;
+
+	for (p = buf; n; p += got, n -= got)
+		if ((got = read(fd, p, n)) <= 0) {
+			if (got == -1 && errno == EINTR) {
+				got = 0;
+				continue;
+			}
+			return -1;
+		}
+	return 0;
+}
+
+static int
+writen(int fd, const void *buf, size_t n)
+{
+	const unsigned char *p;
+	ssize_t got;
+
+	for (p = buf; n; p += got, n -= got)
+		if ((got = write(fd, p, n)) == -1) {
+			if (errno == EINTR) {
+				got = 0;
+				continue;
+			}
+			return -1;
+		}
+	return 0;
+}
+
+/* Read and throw away 'n' bytes */
+static int
+skipn(int fd, uint64_t n)
+{
+	unsigned char buf[4096];
+	size_t sz;
+
+	for (; n; n -= sz) {
+		sz = n < sizeof buf ? n : sizeof buf;
+		if (readn(fd, buf, sz) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+optreply(int fd, uint32_t opt, uint32_t type, const void *data, uint32_t len)
+{
+	unsigned char hdr[20];
+
+	put64(hdr, NBD_REPMAGIC);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, type);
+	put32(hdr + 16, len);
+	if (writen(fd, hdr, sizeof hdr) == -1)
+		return -1;
+	return len ? writen(fd, data, len) : 0;
+}
+
+/*
+ * Negotiate the fixed newstyle handshake.  Any export name is accepted,
+ * as there is only one.  Returns 0 once transmission starts, or -1 if the
+ * client went away or gave up.
+ */
+static int
+handshake(struct nbdserver *s, int fd)
+{
+	unsigned char buf[20 + NBD_MAXOPT], info[12];
+	uint32_t cflags, len, opt;
+	uint16_t tflags;
+	uint64_t size;
+
+	size = vmdksize(s->v);
+	tflags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY |
+	    NBD_FLAG_CAN_MULTI_CONN;
+	put64(buf, NBD_MAGIC);
+	put64(buf + 8, NBD_OPTMAGIC);
+	put16(buf + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (writen(fd, buf, 18) == -1 || readn(fd, buf, 4) == -1)
+		return -1;
+	cflags = get32(buf);
+
+	for (;;) {
+		if (readn(fd, buf, 16) == -1 || get64(buf) != NBD_OPTMAGIC)
+			return -1;
+		opt = get32(buf + 8);
+		len = get32(buf + 12);
+		if (len > NBD_MAXOPT) {
+			if (skipn(fd, len) == -1 ||
+			    optreply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0))
+				return -1;
+			continue;
+		}
+		if (readn(fd, buf, len) == -1)
+			return -1;
+
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME:
+			put64(buf, size);
+			put16(buf + 8, tflags);
+			memset(buf + 10, '\0', 124);
+			return writen(fd, buf, cflags & NBD_FLAG_C_NO_ZEROES ?
+			    10 : 134);
+		case NBD_OPT_ABORT:
+			optreply(fd, opt, NBD_REP_ACK, NULL, 0);
+			return -1;
+		case NBD_OPT_LIST:
+			put32(buf, 0);		/* An empty name */
+			if (optreply(fd, opt, NBD_REP_SERVER, buf, 4) == -1 ||
+			    optreply(fd, opt, NBD_REP_ACK, NULL, 0) == -1)
+				return -1;
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			put16(info, NBD_INFO_EXPORT);
+			put64(info + 2, size);
+			put16(info + 10, tflags);
+			if (optreply(fd, opt, NBD_REP_INFO, info,
+			    sizeof info) == -1 ||
+			    optreply(fd, opt, NBD_REP_ACK, NULL, 0) == -1)
+				return -1;
+			if (opt == NBD_OPT_GO)
+				return 0;
+			break;
+		default:
+			if (optreply(fd, opt, NBD_REP_ERR_UNSUP, NULL, 0) == -1)
+				return -1;
+			break;
+		}
+	}
+}
+
+static void
+reply(struct nbdconn *c, uint32_t err, uint64_t handle, unsigned char *buf,
+    uint32_t len)
+{
+	put32(buf, NBD_SIMPLEMAGIC);
+	put32(buf + 4, err);
+	put64(buf + 8, handle);
+	pthread_mutex_lock(&c->wlock);
+	writen(c->fd, buf, 16 + (err ? 0 : len));
+	pthread_mutex_unlock(&c->wlock);
+}
+
+static void *
+worker(void *arg)
+{
+	struct nbdserver *s = arg;
+	unsigned char *buf, hdr[16];
+	struct nbdjob *j;
+	uint32_t err;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (s->head == NULL && !s->quit)
+			pthread_cond_wait(&s->work, &s->lock);
+		if ((j = s->head) == NULL)
+			break;
+		if ((s->head = j->next) == NULL)
+			s->tail = NULL;
+		s->queued--;
+		pthread_mutex_unlock(&s->lock);
+
+		err = 0;
+		if ((buf = malloc(16 + (size_t)j->len)) == NULL)
+			err = NBD_ENOMEM;
+		else if (vmdkpread(s->v, buf + 16, j->len, j->off) != j->len)
+			err = NBD_EIO;
+		reply(j->c, err, j->handle, buf ? buf : hdr, j->len);
+		free(buf);
+
+		pthread_mutex_lock(&s->lock);
+		if (!err) {
+			s->st->requests++;
+			s->st->bytes += j->len;
+			s->st->ns += now() - j->start;
+		}
+		j->c->pending--;
+		pthread_cond_broadcast(&s->done);
+		free(j);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+struct connarg {
+	struct nbdserver *s;
+	struct nbdconn	*c;
+};
+
+static void
+enqueue(struct nbdserver *s, struct nbdjob *j)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->queued >= s->maxqueued)
+		pthread_cond_wait(&s->done, &s->lock);
+	j->next = NULL;
+	if (s->tail)
+		s->tail->next = j;
+	else
+		s->head = j;
+	s->tail = j;
+	s->queued++;
+	j->c->pending++;
+	pthread_cond_signal(&s->work);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *
+conn(void *arg)
+{
+	struct connarg *a = arg;
+	struct nbdserver *s = a->s;
+	struct nbdconn *c = a->c, **cp;
+	unsigned char req[28], hdr[16];
+	struct nbdjob *j;
+	uint32_t err, len;
+	uint64_t off, size;
+	uint16_t type;
+
+	free(a);
+	size = vmdksize(s->v);
+	if (handshake(s, c->fd) == 0)
+		while (readn(c->fd, req, sizeof req) == 0 &&
+		    get32(req) == NBD_REQMAGIC) {
+			type = get16(req + 6);
+			off = get64(req + 16);
+			len = get32(req + 24);
+			if (type == NBD_CMD_DISC)
+				break;
+			err = 0;
+			if (type == NBD_CMD_WRITE) {
+				if (skipn(c->fd, len) == -1)
+					break;
+				err = NBD_EPERM;
+			} else if (type == NBD_CMD_READ) {
+				if (len > NBD_MAXREAD || off > size ||
+				    len > size - off)
+					err = NBD_EINVAL;
+			} else if (type != NBD_CMD_FLUSH)
+				err = NBD_EINVAL;
+			if (err || type == NBD_CMD_FLUSH) {
+				/* Nothing to do, but keep replies in order */
+				reply(c, err, get64(req + 8), hdr, 0);
+				continue;
+			}
+			if ((j = malloc(sizeof *j)) == NULL) {
+				reply(c, NBD_ENOMEM, get64(req + 8), hdr, 0);
+				continue;
+			}
+			j->c = c;
+			j->handle = get64(req + 8);
+			j->off = off;
+			j->len = len;
+			j->start = now();
+			enqueue(s, j);
+		}
+
+	pthread_mutex_lock(&s->lock);
+	while (c->pending)
+		pthread_cond_wait(&s->done, &s->lock);
+	for (cp = &s->conns; *cp != c; cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	s->nconns--;
+	pthread_cond_broadcast(&s->done);
+	pthread_mutex_unlock(&s->lock);
+
+	close(c->fd);
+	pthread_mutex_destroy(&c->wlock);
+	free(c);
+
+	return NULL;
+}
+
+/*
+ * Serve 'v' on the unix domain socket 'path' with 'threads' workers until
+ * a SIGINT or SIGTERM arrives, counting reads in 'st'.  A stale socket at
+ * 'path' is replaced, but anything else there is left alone.
+ */
+int
+nbdserve(struct vmdk *v, const char *path, unsigned threads,
+    struct nbdstats *st)
+{
+	struct sockaddr_un sun;
+	struct sigaction act;
+	sigset_t block, old;
+	struct stat sb;
+	fd_set rfds;
+	struct nbdserver s;
+	struct connarg *a;
+	struct nbdconn *c;
+	pthread_attr_t attr;
+	pthread_t *tid, t;
+	unsigned n;
+	int fd, lfd;
+
+	memset(&sun, '\0', sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode)) {
+			errno = EEXIST;
+			return -1;
+		}
+		unlink(path);
+	}
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof sun) == -1 ||
+	    listen(lfd, 16) == -1 ||
+	    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) == -1) {
+		close(lfd);
+		return -1;
+	}
+
+	memset(&s, '\0', sizeof s);
+	s.v = v;
+	s.st = st;
+	s.maxqueued = threads * NBD_QUEUED;
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.work, NULL);
+	pthread_cond_init(&s.done, NULL);
+
+	/*
+	 * Only this thread sees the signals, and only while it waits in
+	 * pselect(), so one can't slip in before the wait and be missed.
+	 */
+	memset(&act, '\0', sizeof act);
+	act.sa_handler = nbdstop;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	assert(tid = calloc(threads, sizeof *tid));
+	for (n = 0; n < threads; n++)
+		assert(pthread_create(tid + n, NULL, worker, &s) == 0);
+
+	while (!stopping) {
+		FD_ZERO(&rfds);
+		FD_SET(lfd, &rfds);
+		if (pselect(lfd + 1, &rfds, NULL, NULL, NULL, &old) == -1) {
+			if (errno != EINTR)
+				perror("pselect");
+			continue;
+		}
+		if ((fd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			continue;
+		}
+		/* Some systems pass O_NONBLOCK on from the listener */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		if ((c = calloc(1, sizeof *c)) == NULL ||
+		    (a = malloc(sizeof *a)) == NULL) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		pthread_mutex_init(&c->wlock, NULL);
+		a->s = &s;
+		a->c = c;
+		pthread_mutex_lock(&s.lock);
+		c->next = s.conns;
+		s.conns = c;
+		s.nconns++;
+		pthread_mutex_unlock(&s.lock);
+		assert(pthread_create(&t, &attr, conn, a) == 0);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	close(lfd);
+	unlink(path);
+
+	/* Disconnect everyone and wait for their replies to go out */
+	pthread_mutex_lock(&s.lock);
+	for (c = s.conns; c; c = c->next)
+		shutdown(c->fd, SHUT_RD);
+	while (s.nconns)
+		pthread_cond_wait(&s.done, &s.lock);
+	s.quit = 1;
+	pthread_cond_broadcast(&s.work);
+	pthread_mutex_unlock(&s.lock);
+	for (n = 0; n < threads; n++)
+		pthread_join(tid[n], NULL);
+	free(tid);
+
+	pthread_attr_destroy(&attr);
+	pthread_cond_destroy(&s.done);
+	pthread_cond_destroy(&s.work);
+	pthread_mutex_destroy(&s.lock);
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 12;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/adaptive.raw";
+my $vmdkfn = "$d/adaptive.vmdk";
+my $jvmdkfn = "$d/adaptive-j.vmdk";
+my $tvmdkfn = "$d/adaptive-t.vmdk";
+my $trawfn = "$d/adaptive-t.raw";
+my $rfn = "$d/adaptive.raw-r";
+my $sfn = "$d/adaptive.raw-s";
+
+create_raw_file: {
+    # Noise in grains 0-3, text in grains 4-5 and 129, holes in between
+    my $seed = 1;
+    my $noise = '';
+    for (1 .. 4 * 65536) {
+	$seed = ($seed * 1103515245 + 12345) % 2147483648;
+	$noise .= pack 'C', $seed >> 16 & 255;
+    }
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, $noise;
+    syswrite $fd, "compressible text " x 7000;
+    seek $fd, 129 * 65536, SEEK_SET;
+    syswrite $fd, "the end " x 8192;
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+adaptive_output: {
+    chomp(my @out = `$cmd -d -A -v $vmdkfn $rawfn 2>/dev/null`);
+    is($?, 0, "Created $vmdkfn from $rawfn with -A");
+    ok(grep(/^Stored 4 incompressible grains$/, @out),
+	"The four noisy grains were stored");
+    system "$cmd -j3 -A -v $jvmdkfn $rawfn";
+    is($?, 0, "Created $jvmdkfn from $rawfn with -j3 -A");
+    system "cmp -s $vmdkfn $jvmdkfn";
+    is($?, 0, "$vmdkfn and $jvmdkfn are the same");
+
+    # Small grains are sampled whole, so the noise still looks like noise
+    chomp(@out = `$cmd -d -A -g4k -v $jvmdkfn $rawfn 2>/dev/null`);
+    ok(grep(/^Stored 64 incompressible grains$/, @out),
+	"The noise was stored in 64 4k grains");
+    system "$cmd -r $rfn $jvmdkfn && cmp -s $rawfn $rfn";
+    is($?, 0, "$jvmdkfn with 4k grains reads back");
+}
+
+recreate_and_verify_raw_file: {
+    system "$cmd -r $rfn $vmdkfn";
+    print "# Comparing $rawfn and $rfn\n";
+    system "cmp -l $rawfn $rfn";
+    is($?, 0, "$rawfn and $rfn are the same");
+
+    system "$cmd -s $sfn $vmdkfn";
+    print "# Comparing $rawfn and $sfn\n";
+    system "cmp -l $rawfn $sfn";
+    is($?, 0, "$rawfn and $sfn are the same");
+}
+
+target_rate: {
+    # Only deflated grains count towards the rate, so write 80 of them
+    sysopen my $fd, $trawfn, O_CREAT | O_TRUNC | O_RDWR or die "$trawfn: $!";
+    syswrite $fd, substr("grain $_ of 80 " x 5000, 0, 65536) for 0 .. 79;
+    close $fd;
+
+    # Nothing converts at 100GB/s, so the strength comes down
+    chomp(my @out = `$cmd -d -z9 -T 100000 -v $tvmdkfn $trawfn 2>/dev/null`);
+    is($?, 0, "Created $tvmdkfn from $trawfn with -T");
+    ok(grep(/deflate level now 8$/, @out), "The deflate level was lowered");
+    system "$cmd -r $rfn $tvmdkfn";
+    system "cmp -s $trawfn $rfn";
+    is($?, 0, "$trawfn and $rfn are the same");
+}
@@ -0,0 +1,62 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 13;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/dedup.raw";
+my $vmdkfn = "$d/dedup.vmdk";
+my $dvmdkfn = "$d/dedup-D.vmdk";
+my $jvmdkfn = "$d/dedup-Dj.vmdk";
+my $rfn = "$d/dedup.raw-r";
+
+create_raw_file: {
+    # 40 grains of noise cycling through 4 patterns, so 36 are copies
+    my $seed = 1;
+    my @pattern;
+    for my $p (0 .. 3) {
+	my $noise = '';
+	for (1 .. 16384) {
+	    $seed = ($seed * 1103515245 + 12345) % 2147483648;
+	    $noise .= pack 'N', $seed;
+	}
+	push @pattern, $noise;
+    }
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, $pattern[$_ % 4] for 0 .. 39;
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+dedup_output: {
+    system "$cmd -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+
+    chomp(my @out = `$cmd -S json -D -v $dvmdkfn $rawfn`);
+    is($?, 0, "Created $dvmdkfn from $rawfn with -D");
+    like($out[-1], qr/"dedup": \{"grains": 36, /, "36 grains were shared");
+    ok(-s $dvmdkfn < (-s $vmdkfn) / 5, "$dvmdkfn is much smaller");
+
+    system "$cmd -D -j4 -v $jvmdkfn $rawfn";
+    is($?, 0, "Created $jvmdkfn from $rawfn with -D and 4 threads");
+    system "cmp $dvmdkfn $jvmdkfn";
+    is($?, 0, "$dvmdkfn and $jvmdkfn are the same");
+}
+
+dedup_extraction: {
+    for my $how ('-r', '-j4 -r', '-s') {
+	system "$cmd $how $rfn $dvmdkfn";
+	is($?, 0, "Created $rfn from $dvmdkfn with $how");
+	system "cmp $rawfn $rfn";
+	is($?, 0, "$rawfn and $rfn are the same");
+    }
+}
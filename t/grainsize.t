@@ -0,0 +1,67 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 34;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/grainsize.raw";
+my $vmdkfn = "$d/grainsize.vmdk";
+my $jvmdkfn = "$d/grainsize-j.vmdk";
+my $rfn = "$d/grainsize.raw-r";
+my $sfn = "$d/grainsize.raw-s";
+
+create_files: {
+    # 40 64k runs of text and zeros, ending part way through a grain
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    for my $n (0 .. 39) {
+	syswrite $fd, $n % 3 == 1 ? "\0" x 65536 :
+	    substr("run $n of 40 " x 6000, 0, 65536);
+    }
+    syswrite $fd, "the end " x 192;
+    ok(close $fd, "Wrote $rawfn");
+}
+
+for my $g ([ '4k', 8, 128 ], [ '256k', 512, 256 ], [ '1M', 2048, 512 ]) {
+    my ($size, $secs, $gtes) = @$g;
+
+    system "$cmd -g $size -G $gtes -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn with $size grains and $gtes GTEs per GT");
+    my $info = `$cmd -i $vmdkfn`;
+    like($info, qr/^grainSize: 0x0*@{[sprintf '%x', $secs]} sectors/m,
+	"The grains are $secs sectors");
+    like($info, qr/^numGTEsPerGT: $gtes$/m, "There are $gtes GTEs per GT");
+
+    system "$cmd -j4 -g $size -G $gtes -v $jvmdkfn $rawfn";
+    is($?, 0, "Created $jvmdkfn with 4 threads");
+    system "cmp $vmdkfn $jvmdkfn";
+    is($?, 0, "$vmdkfn and $jvmdkfn are the same");
+
+    system "$cmd -r $rfn $vmdkfn && cmp $rawfn $rfn";
+    is($?, 0, "$vmdkfn reads back with -r");
+    system "$cmd -s $sfn $vmdkfn && cmp $rawfn $sfn";
+    is($?, 0, "$vmdkfn reads back with -s");
+    system "$cmd -g $size -G $gtes -v - $rawfn >$vmdkfn && " .
+	"$cmd -s $sfn $vmdkfn && cmp $rawfn $sfn";
+    is($?, 0, "A streamed $vmdkfn reads back with -s");
+
+    system "$cmd -m -g $size -G $gtes -v $vmdkfn $rawfn";
+    system "$cmd -r $rfn $vmdkfn && cmp $rawfn $rfn";
+    is($?, 0, "A monolithicSparse $vmdkfn reads back with -r");
+}
+
+for my $bad ('-g 3k', '-g 2k', '-g 2M', '-G 96', '-G 1024') {
+    system "$cmd $bad -v $vmdkfn $rawfn 2>/dev/null";
+    isnt($?, 0, "$bad is refused");
+}
+system "$cmd -g 64k -r $rfn $vmdkfn 2>/dev/null";
+isnt($?, 0, "-g is only for writing");
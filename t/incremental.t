@@ -0,0 +1,66 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 12;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/incremental.raw";
+my $vmdkfn = "$d/incremental.vmdk";
+my $newfn = "$d/incremental-new.vmdk";
+my $jnewfn = "$d/incremental-newj.vmdk";
+my $freshfn = "$d/incremental-fresh.vmdk";
+my $rfn = "$d/incremental.raw-r";
+
+create_files: {
+    # 16 grains of text, 14 of them with data
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    for my $g (0 .. 15) {
+	syswrite $fd, $g == 5 || $g == 6 ? "\0" x 65536 :
+	    substr("grain $g of 16 " x 5000, 0, 65536);
+    }
+    ok(close $fd, "Wrote $rawfn");
+    system "$cmd -z9 -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+
+    # Change grain 3 and fill in grain 6
+    sysopen $fd, $rawfn, O_RDWR or die "$rawfn: $!";
+    sysseek $fd, 3 * 65536 + 1000, SEEK_SET;
+    syswrite $fd, "changed";
+    sysseek $fd, 6 * 65536, SEEK_SET;
+    syswrite $fd, "new data " x 100;
+    ok(close $fd, "Changed grains 3 and 6 of $rawfn");
+}
+
+incremental: {
+    chomp(my @out = `$cmd -S json -z9 -I $vmdkfn -v $newfn $rawfn`);
+    is($?, 0, "Created $newfn from $rawfn with -I $vmdkfn");
+    like($out[-1], qr/"reused": 13,/, "13 grains were copied");
+
+    system "$cmd -z9 -v $freshfn $rawfn";
+    is($?, 0, "Created $freshfn from $rawfn");
+    system "cmp $newfn $freshfn";
+    is($?, 0, "$newfn and $freshfn are the same");
+
+    system "$cmd -j4 -z9 -I $vmdkfn -v $jnewfn $rawfn";
+    is($?, 0, "Created $jnewfn from $rawfn with -I and 4 threads");
+    system "cmp $newfn $jnewfn";
+    is($?, 0, "$newfn and $jnewfn are the same");
+
+    system "$cmd -r $rfn $newfn";
+    is($?, 0, "Created $rfn from $newfn");
+    system "cmp $rawfn $rfn";
+    is($?, 0, "$rawfn and $rfn are the same");
+
+    system "$cmd -I $vmdkfn -v $vmdkfn $rawfn 2>/dev/null";
+    isnt($?, 0, "The reference can't be the output");
+}
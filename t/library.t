@@ -0,0 +1,66 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 19;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+my $read = "$dir/t/vmdkread";
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/library.raw";
+my $vmdkfn = "$d/library.vmdk";
+my $mvmdkfn = "$d/library-m.vmdk";
+
+my $raw;
+create_raw_file: {
+    # 20 grains, with noise in grains 1-4 and 9, text in 12 and a hole
+    my $seed = 7;
+    my $noise = '';
+    for (1 .. 5 * 16384) {
+	$seed = ($seed * 1103515245 + 12345) % 2147483648;
+	$noise .= pack 'N', $seed;
+    }
+    $raw = "\0" x (20 * 65536);
+    substr($raw, 65536, 4 * 65536) = substr($noise, 0, 4 * 65536);
+    substr($raw, 9 * 65536, 65536) = substr($noise, 4 * 65536);
+    substr($raw, 12 * 65536 + 100, 12) = "library test";
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, $raw;
+    ok(close $fd, "Wrote $rawfn");
+}
+
+library_reads: {
+    system "$cmd -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+    system "$cmd -m -v $mvmdkfn $rawfn";
+    is($?, 0, "Created $mvmdkfn from $rawfn with -m");
+
+    for my $fn ($vmdkfn, $mvmdkfn) {
+	chomp(my $size = `$read 0 $fn size`);
+	is($size, length $raw, "$fn holds a disk of the right size");
+
+	# Reads within and across grains, with a cache of only 2 grains
+	for my $r ([0, 512], [65000, 1000], [65536 * 3 - 7, 65550],
+	    [12 * 65536 + 90, 40], [9 * 65536, 3 * 65536],
+	    [20 * 65536 - 100, 1000]) {
+	    my ($off, $len) = @$r;
+	    my $got = `$read 2 $fn $off $len`;
+	    ok($? == 0 && $got eq substr($raw, $off, $len),
+		"$len bytes at $off of $fn are right");
+	}
+    }
+
+    my $all = `$read 0 $vmdkfn 0 ${\ length $raw}`;
+    ok($all eq $raw, "The whole of $vmdkfn reads back through the library");
+
+    system "$read 0 $rawfn size 2>/dev/null";
+    isnt($?, 0, "$rawfn isn't opened as a VMDK");
+}
@@ -0,0 +1,62 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 17;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/monolithic.raw";
+my $vmdkfn = "$d/monolithic.vmdk";
+my $uvmdkfn = "$d/monolithic-U.vmdk";
+my $rfn = "$d/monolithic.raw-r";
+
+create_raw_file: {
+    # Text in grains 0 and 3 of 1000, the rest is a hole
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, "monolithic " x 5957;
+    seek $fd, 3 * 65536, SEEK_SET;
+    syswrite $fd, "monolithic " x 5957;
+    truncate $fd, 1000 * 65536;
+    ok(close $fd, "Wrote $rawfn");
+}
+
+monolithic_output: {
+    system "$cmd -m -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn with -m");
+    ok(-s $vmdkfn == 3 * 65536, "$vmdkfn holds the overhead and 2 grains");
+
+    my @info = `$cmd -i $vmdkfn`;
+    is($?, 0, "Read the header of $vmdkfn");
+    ok((grep /^version: 1$/, @info), "$vmdkfn is a version 1 extent");
+    ok((grep /redundant grain table/, @info), "$vmdkfn has redundant GTs");
+    ok((grep /createType="monolithicSparse"/, @info),
+	"$vmdkfn is described as monolithicSparse");
+
+    system "$cmd -U -m -v $uvmdkfn $rawfn";
+    is($?, 0, "Created $uvmdkfn from $rawfn with -U -m");
+    system "cmp -i 1024 $vmdkfn $uvmdkfn";
+    is($?, 0, "$vmdkfn and $uvmdkfn only differ in their descriptor");
+}
+
+monolithic_extraction: {
+    for my $how ('-r', '-j4 -r', '-M -r') {
+	system "$cmd $how $rfn $vmdkfn";
+	is($?, 0, "Created $rfn from $vmdkfn with $how");
+	system "cmp $rawfn $rfn";
+	is($?, 0, "$rawfn and $rfn are the same");
+    }
+
+    system "$cmd -s $rfn $vmdkfn 2>/dev/null";
+    isnt($?, 0, "$vmdkfn can't be read as a stream");
+    system "$cmd -m -v - $rawfn >/dev/null 2>&1";
+    isnt($?, 0, "-m can't write to stdout");
+}
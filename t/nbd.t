@@ -0,0 +1,178 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 20;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR);
+use File::Path qw(mkpath rmtree);
+use IO::Socket::UNIX;
+use POSIX qw(WNOHANG);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/nbd.raw";
+my $vmdkfn = "$d/nbd.vmdk";
+my $rfn = "$d/nbd.raw-r";
+my $sock = "$d/nbd.sock";
+my $statfn = "$d/nbd.stats";
+
+sub readn {
+    my ($s, $n) = @_;
+    my $buf = '';
+    while (length $buf < $n) {
+	my $got = sysread $s, $buf, $n - length $buf, length $buf;
+	return undef unless $got;
+    }
+    return $buf;
+}
+
+sub request {
+    my ($s, $type, $handle, $off, $len) = @_;
+    syswrite $s, pack('N n n Q> Q> N', 0x25609513, 0, $type, $handle, $off,
+	$len);
+}
+
+# Read a simple reply, returning the error, the handle and any data
+sub reply {
+    my ($s, %len) = @_;
+    my ($magic, $err, $handle) = unpack 'N N Q>', readn($s, 16);
+    die "Bad reply magic" unless $magic == 0x67446698;
+    my $data = $err || !$len{$handle} ? '' : readn($s, $len{$handle});
+    return ($err, $handle, $data);
+}
+
+# The fixed newstyle handshake, finishing with NBD_OPT_GO
+sub connect_go {
+    my $s = IO::Socket::UNIX->new(Peer => $sock) or die "$sock: $!";
+    my ($magic, $opt, $flags) = unpack 'a8 a8 n', readn($s, 18);
+    die "Bad server greeting" unless $magic eq 'NBDMAGIC' &&
+	$opt eq 'IHAVEOPT' && $flags & 1;
+    syswrite $s, pack('N', 3);
+    syswrite $s, 'IHAVEOPT' . pack('N N N n', 7, 6, 0, 0);
+    my $size;
+    for (;;) {
+	my (undef, undef, $type, $len) = unpack 'Q> N N N', readn($s, 20);
+	my $data = $len ? readn($s, $len) : '';
+	last if $type == 1;
+	die "Option refused" if $type & 0x80000000;
+	(undef, $size) = unpack 'n Q>', $data if $type == 3;
+    }
+    return ($s, $size);
+}
+
+create_files: {
+    # 64 grains, with noise in every fourth and text elsewhere
+    my $seed = 3;
+    my $noise = '';
+    for (1 .. 16384) {
+	$seed = ($seed * 1103515245 + 12345) % 2147483648;
+	$noise .= pack 'N', $seed;
+    }
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    for my $g (0 .. 63) {
+	syswrite $fd, $g % 4 ? substr("grain $g " x 8192, 0, 65536) : $noise;
+    }
+    ok(close $fd, "Wrote $rawfn");
+    system "$cmd -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+    system "$cmd -r $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn");
+}
+
+my $pid = fork;
+die "fork: $!" unless defined $pid;
+if (!$pid) {
+    open STDOUT, '>', $statfn or die "$statfn: $!";
+    exec "$cmd -S json -j 4 -q 8 -n $sock $vmdkfn" or die "$cmd: $!";
+}
+for (1 .. 100) {
+    last if -S $sock;
+    select undef, undef, undef, 0.05;
+}
+ok(-S $sock, "Serving $vmdkfn on $sock");
+
+my $raw = do { local $/; open my $fh, '<', $rfn or die "$rfn: $!"; <$fh> };
+
+nbd_reads: {
+    my ($s, $size) = connect_go();
+    is($size, length $raw, "The export is the size of $rfn");
+
+    # Pipelined reads within and across grains; replies may come back in
+    # any order
+    my @reads = ([0, 4096], [65530, 20], [3 * 65536 + 100, 2 * 65536],
+	[40 * 65536, 65536], [length($raw) - 512, 512], [12345, 1]);
+    my (%len, %want);
+    for my $h (0 .. $#reads) {
+	my ($off, $len) = @{$reads[$h]};
+	request($s, 0, $h + 1, $off, $len);
+	$len{$h + 1} = $len;
+	$want{$h + 1} = substr $raw, $off, $len;
+    }
+    my $right = 0;
+    for (@reads) {
+	my ($err, $h, $data) = reply($s, %len);
+	$right++ if !$err && $data eq $want{$h};
+    }
+    is($right, scalar @reads, "All pipelined reads matched $rfn");
+
+    request($s, 0, 100, length $raw, 512);
+    my ($err, $h) = reply($s);
+    ok($err == 22 && $h == 100, "Reading beyond the end fails with EINVAL");
+
+    request($s, 1, 101, 0, 4);
+    syswrite $s, "nope";
+    ($err, $h) = reply($s);
+    ok($err == 1 && $h == 101, "Writing fails with EPERM");
+
+    request($s, 3, 102, 0, 0);
+    ($err, $h) = reply($s);
+    ok($err == 0 && $h == 102, "Flush succeeds");
+
+    # A second connection while the first is still open
+    my ($s2) = connect_go();
+    request($s2, 0, 7, 5 * 65536, 65536);
+    my ($err2, $h2, $data2) = reply($s2, 7 => 65536);
+    ok(!$err2 && $data2 eq substr($raw, 5 * 65536, 65536),
+	"A second connection reads the same data");
+
+    request($s, 2, 103, 0, 0);
+    ok(!defined readn($s, 1), "The server closes on NBD_CMD_DISC");
+    close $s2;
+}
+
+whole_disk: {
+    my ($s) = connect_go();
+    my $got = '';
+    for (my $off = 0; $off < length $raw; $off += 1 << 20) {
+	request($s, 0, $off, $off, 1 << 20);
+	my (undef, undef, $data) = reply($s, $off => 1 << 20);
+	$got .= $data;
+    }
+    ok($got eq $raw, "The whole export matches $rfn");
+    request($s, 2, 0, 0, 0);
+    close $s;
+}
+
+shutdown: {
+    kill 'TERM', $pid;
+    is(waitpid($pid, 0), $pid, "The server exited on SIGTERM");
+    is($?, 0, "The server exited cleanly");
+    ok(!-e $sock, "$sock was removed");
+    my $stats = do { local $/; open my $fh, '<', $statfn or die; <$fh> };
+    like($stats, qr/"nbd": \{"reads": 11, "bytes": (\d+), /,
+	"-S counted the reads");
+
+    system "$cmd -n $sock $rawfn 2>/dev/null";
+    isnt($?, 0, "A raw file can't be served");
+    system "$cmd -n $sock -r $rfn $vmdkfn 2>/dev/null";
+    isnt($?, 0, "-n can't be used with -r");
+    system "$cmd -n $rfn $vmdkfn 2>/dev/null";
+    is($? >> 8, 16, "A file in the way of the socket is refused");
+    ok(-s $rfn == length $raw, "$rfn was left alone");
+}
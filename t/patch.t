@@ -0,0 +1,78 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 17;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/patch.raw";
+my $vmdkfn = "$d/patch.vmdk";
+my $streamfn = "$d/patch-stream.vmdk";
+my $patchfn = "$d/patch.bin";
+my $rfn = "$d/patch.raw-r";
+my $sfn = "$d/patch.raw-s";
+
+sub patch {
+    my ($fn, $off, $data) = @_;
+    sysopen my $fd, $fn, O_RDWR or die "$fn: $!";
+    sysseek $fd, $off, SEEK_SET;
+    syswrite $fd, $data;
+    close $fd;
+}
+
+create_files: {
+    # 16 grains of text, 14 of them with data
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    for my $g (0 .. 15) {
+	syswrite $fd, $g == 5 || $g == 6 ? "\0" x 65536 :
+	    substr("grain $g of 16 " x 5000, 0, 65536);
+    }
+    ok(close $fd, "Wrote $rawfn");
+    system "$cmd -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+    system "$cmd -v - $rawfn >$streamfn";
+    is($?, 0, "Created $streamfn from $rawfn");
+
+    # Span grains 3 and 4, fill in grain 6 and zero grain 9
+    sysopen $fd, $patchfn, O_CREAT | O_TRUNC | O_RDWR or die "$patchfn: $!";
+    syswrite $fd, "patched " x 10000;
+    ok(close $fd, "Wrote $patchfn");
+    patch($rawfn, 3 * 65536 + 1000, "patched " x 10000);
+    patch($rawfn, 6 * 65536 + 7, "new data");
+    patch($rawfn, 9 * 65536, "\0" x 65536);
+}
+
+for my $fn ($vmdkfn, $streamfn) {
+    system "$cmd -a $patchfn -o " . (3 * 65536 + 1000) . " $fn";
+    is($?, 0, "Patched grains 3 and 4 of $fn");
+    system "printf 'new data' | $cmd -a - -o " . (6 * 65536 + 7) . " $fn";
+    is($?, 0, "Patched grain 6 of $fn from stdin");
+    system "head -c 64k /dev/zero | $cmd -a - -o 576k $fn";
+    is($?, 0, "Zeroed grain 9 of $fn");
+
+    system "$cmd -r $rfn $fn && cmp $rawfn $rfn";
+    is($?, 0, "$fn reads back with -r");
+    system "$cmd -s $sfn $fn && cmp $rawfn $sfn";
+    is($?, 0, "$fn reads back with -s");
+}
+
+# The old file is left as it was, so cutting a patch off undoes it
+my $size = -s $streamfn;
+system "$cmd -a $patchfn $streamfn";
+truncate $streamfn, $size;
+system "$cmd -r $rfn $streamfn && cmp $rawfn $rfn";
+is($?, 0, "$streamfn is intact without the appended patch");
+
+system "$cmd -a $patchfn -o 1000k $vmdkfn 2>/dev/null";
+isnt($?, 0, "A patch beyond the end of the disk is refused");
+system "$cmd -a $patchfn $rawfn 2>/dev/null";
+isnt($?, 0, "Only a VMDK can be patched");
@@ -0,0 +1,75 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 8;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/physorder.raw";
+my $vmdkfn = "$d/physorder.vmdk";
+my $rfn = "$d/physorder.raw-r";
+
+create_raw_file: {
+    # Text in grains 0, 3 and 4, each compressing to a single sector
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    for my $grain (0, 3, 4) {
+	seek $fd, $grain * 65536, SEEK_SET;
+	syswrite $fd, "grain $grain is out of order " x 100;
+    }
+    truncate $fd, 6 * 65536;
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+reorder_grains: {
+    system "$cmd -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+
+    # Swap where grains 0 and 4 are stored, along with their GTEs
+    open my $fh, '+<', $vmdkfn or die "$vmdkfn: $!";
+    binmode $fh;
+    my ($buf, @gte, @data);
+    sysseek $fh, 56, SEEK_SET;
+    sysread $fh, $buf, 8;
+    my $gd = unpack 'Q<', $buf;
+    sysseek $fh, $gd * 512, SEEK_SET;
+    sysread $fh, $buf, 4;
+    my $gt = unpack 'V', $buf;
+    for my $grain (0, 4) {
+	sysseek $fh, $gt * 512 + $grain * 4, SEEK_SET;
+	sysread $fh, $buf, 4;
+	push @gte, unpack 'V', $buf;
+	sysseek $fh, $gte[-1] * 512, SEEK_SET;
+	sysread $fh, $buf, 512;
+	push @data, $buf;
+    }
+    for my $i (0, 1) {
+	sysseek $fh, $gt * 512 + (4 * $i) * 4, SEEK_SET;
+	syswrite $fh, pack 'V', $gte[1 - $i];
+	sysseek $fh, $gte[1 - $i] * 512, SEEK_SET;
+	syswrite $fh, $data[$i];
+    }
+    ok(close $fh, "Stored grain 0 after grain 4 in $vmdkfn");
+}
+
+sorted_extraction: {
+    chomp(my @out = `$cmd -S text -r $rfn $vmdkfn`);
+    is($?, 0, "Created $rfn from $vmdkfn");
+    ok(grep(/^Input seeks: 2 avoided$/, @out),
+	"Both backward seeks were avoided");
+    system "cmp $rawfn $rfn";
+    is($?, 0, "$rawfn and $rfn are the same");
+
+    system "$cmd -j2 -r $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn with 2 threads");
+    system "cmp $rawfn $rfn";
+    is($?, 0, "$rawfn and $rfn are the same");
+}
@@ -0,0 +1,70 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 12;
+use Compress::Zlib;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/sparse.raw";
+my $zrawfn = "$d/sparse.raw-z";
+my $vmdkfn = "$d/sparse.vmdk";
+my $rfn = "$d/sparse.raw-r";
+
+create_raw_files: {
+    # Text in grains 0 and 2 of 8, with grain 2 zeroed in the second file
+    for my $fn ($rawfn, $zrawfn) {
+	sysopen my $fd, $fn, O_CREAT | O_TRUNC | O_RDWR or die "$fn: $!";
+	syswrite $fd, "sparse " x 9362;
+	if ($fn eq $rawfn) {
+	    seek $fd, 2 * 65536, SEEK_SET;
+	    syswrite $fd, "sparse " x 9362;
+	}
+	truncate $fd, 8 * 65536;
+	ok(close $fd, "Wrote $fn");
+    }
+}
+
+zero_grain: {
+    system "$cmd -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+
+    # Replace grain 2's data with deflated zeros, as some writers do
+    open my $fh, '+<', $vmdkfn or die "$vmdkfn: $!";
+    binmode $fh;
+    my $buf;
+    sysseek $fh, 56, SEEK_SET;
+    sysread $fh, $buf, 8;
+    my $gd = unpack 'Q<', $buf;
+    sysseek $fh, $gd * 512, SEEK_SET;
+    sysread $fh, $buf, 4;
+    my $gt = unpack 'V', $buf;
+    sysseek $fh, $gt * 512 + 2 * 4, SEEK_SET;
+    sysread $fh, $buf, 4;
+    my $zdata = compress("\0" x 65536);
+    sysseek $fh, unpack('V', $buf) * 512 + 8, SEEK_SET;
+    syswrite $fh, pack('V', length $zdata) . $zdata;
+    ok(close $fh, "Grain 2 of $vmdkfn inflates to zeros");
+}
+
+sparse_output: {
+    for my $how ('-r', '-U -r', '-s') {
+	system "$cmd $how $rfn $vmdkfn";
+	is($?, 0, "Created $rfn from $vmdkfn with $how");
+	system "cmp $zrawfn $rfn";
+	is($?, 0, "$zrawfn and $rfn are the same");
+    }
+    ok((stat $rfn)[12] * 512 < 2 * 65536, "Only grain 0 of $rfn was written");
+
+    system "$cmd -P -r $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn with -P");
+}
@@ -0,0 +1,55 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 9;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/stats.raw";
+my $vmdkfn = "$d/stats.vmdk";
+my $rfn = "$d/stats.raw-r";
+
+create_raw_file: {
+    # Text in grains 0 and 3, zeros in grain 1 and holes in grains 2 and 4
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, "some statistics " x 100;
+    seek $fd, 65536, SEEK_SET;
+    syswrite $fd, "\0" x 65536;
+    seek $fd, 3 * 65536, SEEK_SET;
+    syswrite $fd, "more statistics " x 100;
+    truncate $fd, 5 * 65536;
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+vmdk_stats: {
+    chomp(my @out = `$cmd -S json -Z -v $vmdkfn $rawfn`);
+    is($?, 0, "Created $vmdkfn from $rawfn");
+    like($out[-1], qr/"grains": \{"total": 5, "allocated": 2, "zero": 1, "unallocated": 2\}/,
+	"Grains were counted");
+    like($out[-1], qr/"sectors": \{"1": 2,/, "Both grains fit in a sector");
+}
+
+raw_stats: {
+    chomp(my @out = `$cmd -S text -r $rfn $vmdkfn`);
+    is($?, 0, "Created $rfn from $vmdkfn");
+    ok(grep(/^Grains: 5 total, 2 allocated, 1 zero, 2 unallocated$/, @out),
+	"Grains were counted");
+    ok(grep(/^System calls: \d+ read, \d+ write$/, @out),
+	"System calls were counted");
+}
+
+progress: {
+    system "$cmd -p 1 -s $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn with -p");
+    system "$cmd -p 1 -i $vmdkfn >/dev/null 2>&1";
+    isnt($?, 0, "-p needs a conversion");
+}
@@ -0,0 +1,74 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 12;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/stream.raw";
+my $vmdkfn = "$d/stream.vmdk";
+my $seekfn = "$d/seek.vmdk";
+my $sfn = "$d/stream.raw-s";
+my $rfn = "$d/stream.raw-r";
+
+create_raw_file: {
+    # Text in the first grain table, a hole, then more text in the third
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, "streamed data " x 20000;
+    seek $fd, 2 * 512 * 65536 + 4096, SEEK_SET;
+    syswrite $fd, "more streamed data " x 2000;
+    truncate $fd, 3 * 512 * 65536;
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+create_vmdk_file: {
+    # Through a pipe so that nothing can seek
+    system "$cmd -v - $rawfn | cat >$vmdkfn";
+    is($?, 0, "Streamed $vmdkfn from $rawfn");
+    system "$cmd -v $seekfn $rawfn";
+    is($?, 0, "Created $seekfn from $rawfn");
+    is(-s $vmdkfn, -s $seekfn, "Both VMDKs are the same size");
+}
+
+check_header: {
+    open my $fd, '<', $vmdkfn or die "$vmdkfn: $!";
+    binmode $fd;
+    read $fd, my $h, 512;
+    my ($magic, $gd) = unpack 'a4 x52 q<', $h;
+    is($magic, 'KDMV', "$vmdkfn starts with a header");
+    is($gd, -1, "The leading header has no grain directory offset");
+}
+
+check_diag: {
+    system "$cmd -dd -j3 -v - $rawfn 2>/dev/null | cmp -s - $vmdkfn";
+    is($?, 0, "Diagnostics don't end up in the streamed VMDK");
+}
+
+recreate_and_verify_raw_file: {
+    system "$cmd -r $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn");
+    system "$cmd -s $sfn $vmdkfn";
+    is($?, 0, "Created $sfn from $vmdkfn");
+
+    print "# Comparing $rawfn and $rfn\n";
+    system "cmp -l $rawfn $rfn";
+    is($?, 0, "$rawfn and $rfn are the same");
+
+    print "# Comparing $rawfn and $sfn\n";
+    system "cmp -l $rawfn $sfn";
+    is($?, 0, "$rawfn and $sfn are the same");
+}
+
+device_needs_capacity: {
+    system "$cmd -v - /dev/zero >/dev/null 2>&1";
+    isnt($?, 0, "Streaming a device without -c fails");
+}
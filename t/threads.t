@@ -0,0 +1,136 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 48;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/threads.raw";
+my $vmdkfn = "$d/threads.vmdk";
+my $jvmdkfn = "$d/threads-j.vmdk";
+my $rfn = "$d/threads.raw-r";
+my $jrfn = "$d/threads.raw-jr";
+
+create_raw_file: {
+    # A mix of text, noise and holes over several grain tables
+    my $seed = 1;
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    for my $grain (0 .. 1100) {
+	next if $grain % 7 == 3;
+	seek $fd, $grain * 65536, SEEK_SET;
+	if ($grain % 3) {
+	    syswrite $fd, "grain $grain says hello " x 2048;
+	} else {
+	    my $noise = '';
+	    for (1 .. 16384) {
+		$seed = ($seed * 1103515245 + 12345) % 2147483648;
+		$noise .= pack 'N', $seed;
+	    }
+	    syswrite $fd, $noise;
+	}
+    }
+    seek $fd, 1101 * 65536 + 4096, SEEK_SET;
+    syswrite $fd, "the end";
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+threaded_output_matches: {
+    for my $z (1, 6, 9) {
+	system "$cmd -z$z -v $vmdkfn $rawfn";
+	is($?, 0, "Created $vmdkfn from $rawfn at -z$z");
+
+	system "$cmd -j4 -q3 -z$z -v $jvmdkfn $rawfn";
+	is($?, 0, "Created $jvmdkfn from $rawfn at -z$z with 4 threads");
+
+	system "cmp $vmdkfn $jvmdkfn";
+	is($?, 0, "$vmdkfn and $jvmdkfn are the same at -z$z");
+    }
+}
+
+threaded_capacity: {
+    system "$cmd -j3 -c1M -v $jvmdkfn $rawfn";
+    is($?, 0, "Created a 1M $jvmdkfn with 3 threads");
+
+    system "$cmd -r $rfn $jvmdkfn";
+    is($?, 0, "Created $rfn from $jvmdkfn");
+    is(-s $rfn, 1024 * 1024, "The $rfn file is 1M");
+
+    print "# Comparing $rawfn and $rfn\n";
+    system "cmp -n 1048576 $rawfn $rfn";
+    is($?, 0, "The first 1M of $rawfn and $rfn are the same");
+}
+
+threaded_extraction: {
+    system "$cmd -z1 -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn");
+
+    system "$cmd -r $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn");
+
+    system "$cmd -j4 -r $jrfn $vmdkfn";
+    is($?, 0, "Created $jrfn from $vmdkfn with 4 threads");
+
+    print "# Comparing $rfn and $jrfn\n";
+    system "cmp $rfn $jrfn";
+    is($?, 0, "$rfn and $jrfn are the same");
+}
+
+mapped_extraction: {
+    for my $how ('-M -r', '-M -j4 -r', '-M -s') {
+	system "$cmd $how $jrfn $vmdkfn";
+	is($?, 0, "Created $jrfn from $vmdkfn with $how");
+
+	print "# Comparing $rfn and $jrfn\n";
+	system "cmp $rfn $jrfn";
+	is($?, 0, "$rfn and $jrfn are the same");
+    }
+}
+
+uring_extraction: {
+    for my $how ('-U -r', '-U -j4 -r', '-U -s') {
+	system "$cmd $how $jrfn $vmdkfn";
+	is($?, 0, "Created $jrfn from $vmdkfn with $how");
+
+	print "# Comparing $rfn and $jrfn\n";
+	system "cmp $rfn $jrfn";
+	is($?, 0, "$rfn and $jrfn are the same");
+    }
+}
+
+uring_output_matches: {
+    for my $how ('-U', '-U -j4') {
+	system "$cmd $how -z1 -v $jvmdkfn $rawfn";
+	is($?, 0, "Created $jvmdkfn from $rawfn with $how");
+
+	system "cmp $vmdkfn $jvmdkfn";
+	is($?, 0, "$vmdkfn and $jvmdkfn are the same");
+    }
+}
+
+uncached_io: {
+    for my $how ('-N', '-O', '-O -U -j4') {
+	system "$cmd $how -z1 -v $jvmdkfn $rawfn";
+	is($?, 0, "Created $jvmdkfn from $rawfn with $how");
+
+	system "cmp $vmdkfn $jvmdkfn";
+	is($?, 0, "$vmdkfn and $jvmdkfn are the same");
+    }
+
+    for my $how ('-O -r', '-O -j4 -r', '-N -s', '-O -s') {
+	system "$cmd $how $jrfn $vmdkfn";
+	is($?, 0, "Created $jrfn from $vmdkfn with $how");
+
+	print "# Comparing $rfn and $jrfn\n";
+	system "cmp $rfn $jrfn";
+	is($?, 0, "$rfn and $jrfn are the same");
+    }
+}
@@ -0,0 +1,98 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 17;
+use Digest::SHA qw(sha256_hex);
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/verify.raw";
+my $vmdkfn = "$d/verify.vmdk";
+my $badfn = "$d/verify-bad.vmdk";
+my ($digest, $raw);
+
+create_files: {
+    # 20 grains of text with a hole and a repeat, ending part way through
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    my $data = '';
+    for my $g (0 .. 19) {
+	my $n = $g == 9 ? 8 : $g;
+	$data .= $g == 4 ? "\0" x 65536 :
+	    substr("grain $n of 20 " x 6000, 0, 65536);
+    }
+    $data .= "the end " x 128;
+    syswrite $fd, $data;
+    ok(close $fd, "Wrote $rawfn");
+    $digest = sha256_hex($raw = $data);
+}
+
+for my $args ('', '-j1 -q1', '-j4', '-D', '-m', '-Z', '-g 16k -G 128') {
+    system "$cmd $args -v $vmdkfn $rawfn";
+    my $out = `$cmd -C $vmdkfn`;
+    is($out, "SHA256 ($vmdkfn) = $digest\n",
+	"-C of $vmdkfn written with '$args' matches $rawfn");
+}
+
+system "$cmd -v - $rawfn >$vmdkfn";
+is(`$cmd -j3 -C $vmdkfn`, "SHA256 ($vmdkfn) = $digest\n",
+    "-C of a streamed $vmdkfn matches $rawfn");
+
+like(`$cmd -S json -C $vmdkfn`, qr/"allocated": 20,/,
+    "-S counts the grains checked");
+
+corrupt: {
+    system "$cmd -v $vmdkfn $rawfn && cp $vmdkfn $badfn";
+    # Flip bytes in the middle of grain 0's deflate stream
+    sysopen my $fd, $badfn, O_RDWR or die "$badfn: $!";
+    sysseek $fd, 128 * 512 + 100, SEEK_SET;
+    syswrite $fd, "garbage" x 4;
+    close $fd;
+    my $out = `$cmd -C $badfn 2>&1`;
+    is($? >> 8, 19, "A damaged grain fails -C");
+    like($out, qr/^Grain 0: /m, "The damaged grain is reported");
+    unlike($out, qr/SHA256/, "No digest is shown");
+
+    # Point grain 1's marker at grain 5
+    system "cp $vmdkfn $badfn";
+    sysopen $fd, $badfn, O_RDWR or die "$badfn: $!";
+    my $gte = grainpos($vmdkfn, 1);
+    sysseek $fd, $gte * 512, SEEK_SET;
+    syswrite $fd, pack('Q<', 5 * 128);
+    close $fd;
+    like(`$cmd -C $badfn 2>&1`, qr/^Grain 1: Grain marker is for a later LBA/m,
+	"A marker for a later LBA is reported");
+
+    # A grain shared by -D is fine, even once -a has zeroed its first use
+    system "$cmd -D -v $vmdkfn $rawfn";
+    is(`$cmd -C $vmdkfn`, "SHA256 ($vmdkfn) = $digest\n",
+	"A grain shared by -D passes");
+    system "head -c 64k /dev/zero | $cmd -a - -o 512k $vmdkfn";
+    my $patched = substr($raw, 0, 8 * 65536) . "\0" x 65536 .
+	substr($raw, 9 * 65536);
+    is(`$cmd -C $vmdkfn`, "SHA256 ($vmdkfn) = @{[sha256_hex($patched)]}\n",
+	"A grain still sharing one that -a zeroed passes");
+}
+
+system "$cmd -C -v $vmdkfn $rawfn 2>/dev/null";
+isnt($?, 0, "-C can't be used with -v");
+
+# Return the GTE of grain 'g' from the first grain table
+sub grainpos {
+    my ($fn, $g) = @_;
+    open my $fd, '<', $fn or die "$fn: $!";
+    binmode $fd;
+    local $/;
+    my $vmdk = <$fd>;
+    my $gd = unpack 'Q<', substr($vmdk, 56, 8);	# gdOffset
+    my $gt = unpack 'V', substr($vmdk, $gd * 512, 4);
+    return unpack 'V', substr($vmdk, $gt * 512 + $g * 4, 4);
+}
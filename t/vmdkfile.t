@@ -2,7 +2,7 @@
 
 use strict;
 use warnings;
-use Test::More tests => 39;
+use Test::More tests => 41;
 use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
 use File::Copy;
 use File::Path qw(mkpath rmtree);
@@ -49,6 +49,19 @@ check_ddb_info: {
     ok(grep(/RDONLY 128 SPARSE/, @ddb), "Created ddb info with 128 blocks");
     ok(grep(/geometry.cylinders = "4"/, @ddb),
 	"Created ddb with correct disk geometry");
+
+    # -i shows the header of a file whose grain map can't be read
+    my $badfn = "$d/file-bad.vmdk";
+    copy($vmdkfn, $badfn);
+    sysopen my $fd, $badfn, O_RDWR or die "$badfn: $!";
+    sysseek $fd, 56, SEEK_SET;		# gdOffset
+    syswrite $fd, pack('Q<', 0x7fffffff);
+    close $fd;
+    @ddb = `$cmd -i $badfn 2>/dev/null`;
+    ok($? == 0 && grep(/RDONLY 128 SPARSE/, @ddb),
+	"Got info from $badfn despite its grain map");
+    system "$cmd -d -i $badfn >/dev/null 2>&1";
+    is($? >> 8, 14, "-d -i can't show its grain map");
 }
 
 recreate_and_verify_raw_file: {
@@ -0,0 +1,51 @@
+/*
+ * Read 'len' bytes at 'offset' of a VMDK's disk through libvmdk and write
+ * them to stdout, or show the disk size, for the tests.  Only vmdk.h, the
+ * installed header, is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vmdk.h"
+
+int
+main(int argc, char **argv)
+{
+	unsigned long long len, off;
+	struct vmdk *v;
+	ssize_t got;
+	char *buf;
+
+	if (argc != 5 && (argc != 4 || strcmp(argv[3], "size"))) {
+		fprintf(stderr, "usage: vmdkread grains file size\n"
+		    "       vmdkread grains file offset len\n");
+		return 1;
+	}
+	if ((v = vmdkopen(argv[2], strtoul(argv[1], NULL, 0))) == NULL) {
+		perror(argv[2]);
+		return 2;
+	}
+	if (strcmp(argv[3], "size") == 0) {
+		printf("%llu\n", (unsigned long long)vmdksize(v));
+		vmdkclose(v);
+		return 0;
+	}
+	off = strtoull(argv[3], NULL, 0);
+	len = strtoull(argv[4], NULL, 0);
+	if ((buf = malloc(len)) == NULL) {
+		perror("malloc");
+		return 3;
+	}
+	if ((got = vmdkpread(v, buf, len, off)) == -1) {
+		perror("vmdkpread");
+		return 4;
+	}
+	fwrite(buf, 1, got, stdout);
+	free(buf);
+	vmdkclose(v);
+
+	return 0;
+}
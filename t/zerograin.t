@@ -0,0 +1,71 @@
+#! /usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 9;
+use Fcntl qw(O_CREAT O_TRUNC O_RDWR SEEK_SET);
+use File::Path qw(mkpath rmtree);
+
+use constant PROG => 'vmdktool';
+
+my $dir = $ENV{EXES} ? "./$ENV{EXES}" : ".";
+my $cmd = "$dir/" . PROG;
+
+my $d = "t/data";
+rmtree $d;
+mkpath $d;
+my $rawfn = "$d/zero.raw";
+my $vmdkfn = "$d/zero.vmdk";
+my $sfn = "$d/zero.raw-s";
+my $rfn = "$d/zero.raw-r";
+
+create_raw_file: {
+    # Data in grains 0 and 3, explicit zeros in grains 1 and 2 and a hole
+    # (if the filesystem supports them) in grain 4
+    sysopen my $fd, $rawfn, O_CREAT | O_TRUNC | O_RDWR or die "$rawfn: $!";
+    syswrite $fd, "grain zero " x 100;
+    seek $fd, 65536, SEEK_SET;
+    syswrite $fd, "\0" x 131072;
+    seek $fd, 3 * 65536 + 512, SEEK_SET;
+    syswrite $fd, "grain three " x 100;
+    truncate $fd, 5 * 65536;
+    ok(close $fd, "Wrote a raw disk file");
+}
+
+create_vmdk_file: {
+    system "$cmd -Z -v $vmdkfn $rawfn";
+    is($?, 0, "Created $vmdkfn from $rawfn with zero-grain GTEs");
+}
+
+check_info: {
+    chomp(my @info = `$cmd -i $vmdkfn`);
+    is($?, 0, "Got info from $vmdkfn");
+    ok(grep(/zero-grain GTE/, @info), "The zero-grain GTE flag is set");
+}
+
+check_table: {
+    chomp(my @dir = `$cmd -di $vmdkfn`);
+    my ($tbl) = map { /^\s+([0-9a-f]{8})\s/ ? hex $1 : () }
+	grep { /^\s+[0-9a-f]{8}/ } @dir;
+    chomp(my @tbl = `$cmd -i -t $tbl $vmdkfn`);
+    my ($ents) = grep { /^\s+[0-9a-f]{8}/ } @tbl;
+    my @ent = split ' ', $ents;
+    is_deeply([@ent[1, 2]], ['00000001', '00000001'],
+	"Grains 1 and 2 have zero-grain GTEs");
+}
+
+recreate_and_verify_raw_file: {
+    system "$cmd -r $rfn $vmdkfn";
+    is($?, 0, "Created $rfn from $vmdkfn");
+
+    system "$cmd -s $sfn $vmdkfn";
+    is($?, 0, "Created $sfn from $vmdkfn");
+
+    print "# Comparing $rawfn and $rfn\n";
+    system "cmp -l $rawfn $rfn";
+    is($?, 0, "$rawfn and $rfn are the same");
+
+    print "# Comparing $rawfn and $sfn\n";
+    system "cmp -l $rawfn $sfn";
+    is($?, 0, "$rawfn and $sfn are the same");
+}
@@ -0,0 +1,287 @@
+/*-
+ * Copyright (c) 2026 The vmdktool authors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct ioq {
+	int		fd;
+	unsigned	entries;
+	unsigned	queued;		/* Prepared but not yet submitted */
+	unsigned	inflight;	/* Submitted but not yet reaped */
+	void		*sqring;
+	size_t		sqringsz;
+	void		*cqring;
+	size_t		cqringsz;
+	struct io_uring_sqe *sqes;
+	size_t		sqesz;
+	unsigned	*sqtail, *sqmask, *sqarray;
+	unsigned	*cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+};
+
+static void *
+ringptr(void *ring, unsigned off)
+{
+	return (char *)ring + off;
+}
+
+/*
+ * Submit what's been prepared and, if 'wait', block until at least one
+ * request has completed.
+ */
+static void
+ioqenter(struct ioq *q, int wait)
+{
+	int n;
+
+	for (;;) {
+		n = syscall(__NR_io_uring_enter, q->fd, q->queued, wait ? 1 : 0,
+		    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n != -1)
+			break;
+		if (errno != EINTR && errno != EAGAIN) {
+			perror("io_uring_enter");
+			abort();
+		}
+	}
+	q->queued -= n;
+	q->inflight += n;
+}
+
+struct ioq *
+ioqopen(unsigned entries)
+{
+	struct io_uring_params p;
+	struct ioq *q;
+
+	if ((q = calloc(1, sizeof *q)) == NULL)
+		return NULL;
+	memset(&p, '\0', sizeof p);
+	q->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (q->fd == -1) {
+		free(q);
+		return NULL;
+	}
+
+	/* IORING_OP_READ and IORING_OP_WRITE arrived with this feature */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	q->entries = p.sq_entries;
+	q->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof *q->cqes;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (q->sqringsz < q->cqringsz)
+			q->sqringsz = q->cqringsz;
+		q->cqringsz = 0;
+	}
+	q->sqring = mmap(NULL, q->sqringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+	if (q->sqring == MAP_FAILED)
+		goto fail;
+	if (q->cqringsz) {
+		q->cqring = mmap(NULL, q->cqringsz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+		if (q->cqring == MAP_FAILED)
+			goto fail;
+	} else
+		q->cqring = q->sqring;
+	q->sqesz = p.sq_entries * sizeof *q->sqes;
+	q->sqes = mmap(NULL, q->sqesz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+	if (q->sqes == MAP_FAILED)
+		goto fail;
+
+	q->sqtail = ringptr(q->sqring, p.sq_off.tail);
+	q->sqmask = ringptr(q->sqring, p.sq_off.ring_mask);
+	q->sqarray = ringptr(q->sqring, p.sq_off.array);
+	q->cqhead = ringptr(q->cqring, p.cq_off.head);
+	q->cqtail = ringptr(q->cqring, p.cq_off.tail);
+	q->cqmask = ringptr(q->cqring, p.cq_off.ring_mask);
+	q->cqes = ringptr(q->cqring, p.cq_off.cqes);
+
+	return q;
+
+fail:
+	ioqclose(q);
+	return NULL;
+}
+
+void
+ioqclose(struct ioq *q)
+{
+	if (q->sqes != NULL && q->sqes != MAP_FAILED)
+		munmap(q->sqes, q->sqesz);
+	if (q->cqringsz && q->cqring != NULL && q->cqring != MAP_FAILED)
+		munmap(q->cqring, q->cqringsz);
+	if (q->sqring != NULL && q->sqring != MAP_FAILED)
+		munmap(q->sqring, q->sqringsz);
+	close(q->fd);
+	free(q);
+}
+
+static void
+ioqprep(struct ioq *q, int op, int fd, uintptr_t buf, size_t n, off_t pos,
+    uint64_t tag)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	/* Callers never have more requests outstanding than the ring holds */
+	assert(q->queued + q->inflight < q->entries);
+
+	tail = *q->sqtail;
+	idx = tail & *q->sqmask;
+	sqe = q->sqes + idx;
+	memset(sqe, '\0', sizeof *sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = buf;
+	sqe->len = n;
+	sqe->off = pos;
+	sqe->user_data = tag;
+	q->sqarray[idx] = idx;
+	__atomic_store_n(q->sqtail, tail + 1, __ATOMIC_RELEASE);
+	q->queued++;
+}
+
+void
+ioqread(struct ioq *q, int fd, void *buf, size_t n, off_t pos, uint64_t tag)
+{
+	ioqprep(q, IORING_OP_READ, fd, (uintptr_t)buf, n, pos, tag);
+}
+
+void
+ioqwrite(struct ioq *q, int fd, const void *buf, size_t n, off_t pos,
+    uint64_t tag)
+{
+	ioqprep(q, IORING_OP_WRITE, fd, (uintptr_t)buf, n, pos, tag);
+}
+
+void
+ioqsubmit(struct ioq *q)
+{
+	while (q->queued)
+		ioqenter(q, 0);
+}
+
+/*
+ * Wait for the next request to complete, returning its tag and its result
+ * (a byte count or a negative errno).  Anything prepared is submitted
+ * first.  Returns -1 if nothing is outstanding.
+ */
+int
+ioqwait(struct ioq *q, uint64_t *tag, ssize_t *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	for (;;) {
+		head = *q->cqhead;
+		if (head != __atomic_load_n(q->cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = q->cqes + (head & *q->cqmask);
+			*tag = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(q->cqhead, head + 1, __ATOMIC_RELEASE);
+			q->inflight--;
+			return 0;
+		}
+		if (!q->queued && !q->inflight)
+			return -1;
+		ioqenter(q, 1);
+	}
+}
+
+#else
+
+struct ioq *
+ioqopen(unsigned entries __attribute__((__unused__)))
+{
+	return NULL;
+}
+
+void
+ioqclose(struct ioq *q __attribute__((__unused__)))
+{
+}
+
+void
+ioqread(struct ioq *q __attribute__((__unused__)),
+    int fd __attribute__((__unused__)), void *buf __attribute__((__unused__)),
+    size_t n __attribute__((__unused__)), off_t pos __attribute__((__unused__)),
+    uint64_t tag __attribute__((__unused__)))
+{
+	abort();
+}
+
+void
+ioqwrite(struct ioq *q __attribute__((__unused__)),
+    int fd __attribute__((__unused__)),
+    const void *buf __attribute__((__unused__)),
+    size_t n __attribute__((__unused__)), off_t pos __attribute__((__unused__)),
+    uint64_t tag __attribute__((__unused__)))
+{
+	abort();
+}
+
+void
+ioqsubmit(struct ioq *q __attribute__((__unused__)))
+{
+}
+
+int
+ioqwait(struct ioq *q __attribute__((__unused__)),
+    uint64_t *tag __attribute__((__unused__)),
+    ssize_t *res __attribute__((__unused__)))
+{
+	return -1;
+}
+
+#endif
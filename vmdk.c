@@ -0,0 +1,511 @@
+/*-
+ * Copyright (c) 2026 The vmdktool authors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define ZLIB_CONST
+#include <zlib.h>
+
+#include "vmdk.h"
+#include "vmdkfmt.h"
+
+#define NOGRAIN		((SectorType)-1)	/* An unused cache entry */
+
+/* A decoded grain, on the LRU list and a hash chain */
+struct vmdkgrain {
+	SectorType	n;
+	unsigned char	*data;
+	struct vmdkgrain *prev, *next;	/* LRU order, most recent first */
+	struct vmdkgrain *hnext;
+};
+
+/*
+ * What a thread needs to decode a grain.  Grains are decoded without the
+ * lock held, so each reader takes a decoder from the idle list.
+ */
+struct vmdkdec {
+	z_stream	strm;
+	unsigned char	*buf;		/* A compressed grain */
+	size_t		bufsz;
+	unsigned char	*grain;		/* Swapped into the cache when done */
+	struct vmdkdec	*next;
+};
+
+struct vmdk {
+	int		fd;
+	uint64_t	size;		/* Bytes in the disk */
+	struct SparseExtentHeader h;
+	struct vmdkmap	map;
+	size_t		grainsz;	/* Bytes in a decoded grain */
+	struct vmdkdec	*dec;		/* Idle decoders */
+	struct vmdkgrain *grain;	/* 'ngrains' cache entries */
+	unsigned	ngrains;
+	struct vmdkgrain *head, *tail;
+	struct vmdkgrain **hash;
+	unsigned	hashsz;		/* A power of 2 */
+	pthread_mutex_t	lock;
+};
+
+static int
+readall(int fd, void *buf, size_t n, off_t pos)
+{
+	ssize_t got;
+	char *p;
+
+	for (p = buf; n; p += got, n -= got, pos += got)
+		if ((got = pread(fd, p, n, pos)) == -1) {
+			if (errno != EINTR)
+				return -1;
+			got = 0;
+		} else if (got == 0) {
+			errno = EIO;
+			return -1;
+		}
+	return 0;
+}
+
+/*
+ * A streamOptimized extent has no grain directory offset in its header,
+ * but a copy of the header with one follows the footer marker, two
+ * sectors before the end of the file.
+ */
+int
+vmdkfooter(int fd, off_t size, struct SparseExtentHeader *h)
+{
+	struct Marker m;
+	off_t pos;
+
+	pos = size - (off_t)(sizeof *h + SECTORSZ * 2);
+	pos -= pos % SECTORSZ;
+	if (pos < SECTORSZ || readall(fd, &m, sizeof m, pos) == -1 ||
+	    m.size || m.u.type != MARKER_FOOTER ||
+	    readall(fd, h, sizeof *h, pos + SECTORSZ) == -1 ||
+	    h->magicNumber != VMDK_MAGIC) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+vmdkloadmap(int fd, const struct SparseExtentHeader *h, struct vmdkmap *map)
+{
+	size_t gdsz, gtsz;
+	SectorType n;
+
+	map->grains = h->capacity / h->grainSize;
+	if (h->capacity % h->grainSize)
+		map->grains++;
+	map->gdents = map->grains / h->numGTEsPerGT;
+	if (map->grains % h->numGTEsPerGT)
+		map->gdents++;
+	gdsz = map->gdents * sizeof(uint32_t);
+	if (gdsz % SECTORSZ)
+		gdsz = (gdsz / SECTORSZ + 1) * SECTORSZ;
+	map->gdsecs = gdsz / SECTORSZ;
+	gtsz = h->numGTEsPerGT * sizeof(uint32_t);
+
+	map->gt = NULL;
+	if ((map->gd = malloc(gdsz)) == NULL ||
+	    readall(fd, map->gd, gdsz, h->gdOffset * SECTORSZ) == -1 ||
+	    (map->gt = calloc(map->gdents, gtsz)) == NULL)
+		goto fail;
+	for (n = 0; n < map->gdents; n++)
+		if (map->gd[n] && readall(fd, map->gt + n * h->numGTEsPerGT,
+		    gtsz, (off_t)map->gd[n] * SECTORSZ) == -1)
+			goto fail;
+	return 0;
+
+fail:
+	vmdkfreemap(map);
+	return -1;
+}
+
+void
+vmdkfreemap(struct vmdkmap *map)
+{
+	free(map->gt);
+	free(map->gd);
+	map->gt = NULL;
+	map->gd = NULL;
+}
+
+static void
+lruunlink(struct vmdk *v, struct vmdkgrain *g)
+{
+	if (g->prev)
+		g->prev->next = g->next;
+	else
+		v->head = g->next;
+	if (g->next)
+		g->next->prev = g->prev;
+	else
+		v->tail = g->prev;
+}
+
+static void
+lrufront(struct vmdk *v, struct vmdkgrain *g)
+{
+	g->prev = NULL;
+	g->next = v->head;
+	if (v->head)
+		v->head->prev = g;
+	else
+		v->tail = g;
+	v->head = g;
+}
+
+struct vmdk *
+vmdkopen(const char *path, unsigned ngrains)
+{
+	struct vmdk *v;
+	struct stat st;
+	unsigned n;
+	int err;
+
+	if ((v = calloc(1, sizeof *v)) == NULL)
+		return NULL;
+	if ((v->fd = open(path, O_RDONLY)) == -1) {
+		free(v);
+		return NULL;
+	}
+	if (fstat(v->fd, &st) == -1 ||
+	    readall(v->fd, &v->h, sizeof v->h, 0) == -1)
+		goto fail;
+	if (v->h.magicNumber != VMDK_MAGIC ||
+	    (v->h.gdOffset + 1 == 0 && vmdkfooter(v->fd, st.st_size, &v->h)) ||
+	    v->h.grainSize == 0 || v->h.grainSize > 1 << 20 ||
+	    v->h.numGTEsPerGT == 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if (vmdkloadmap(v->fd, &v->h, &v->map) == -1)
+		goto fail;
+
+	v->size = v->h.capacity * SECTORSZ;
+	v->grainsz = v->h.grainSize * SECTORSZ;
+	v->ngrains = ngrains ? ngrains : VMDK_CACHEGRAINS;
+	for (v->hashsz = 1; v->hashsz < v->ngrains; v->hashsz <<= 1)
+		;
+	if ((v->grain = calloc(v->ngrains, sizeof *v->grain)) == NULL ||
+	    (v->hash = calloc(v->hashsz, sizeof *v->hash)) == NULL)
+		goto fail;
+	for (n = 0; n < v->ngrains; n++) {
+		if ((v->grain[n].data = malloc(v->grainsz)) == NULL)
+			goto fail;
+		v->grain[n].n = NOGRAIN;
+		lrufront(v, v->grain + n);
+	}
+	pthread_mutex_init(&v->lock, NULL);
+	return v;
+
+fail:
+	err = errno;
+	if (v->grain)
+		for (n = 0; n < v->ngrains; n++)
+			free(v->grain[n].data);
+	free(v->grain);
+	free(v->hash);
+	vmdkfreemap(&v->map);
+	close(v->fd);
+	free(v);
+	errno = err;
+	return NULL;
+}
+
+uint64_t
+vmdksize(const struct vmdk *v)
+{
+	return v->size;
+}
+
+const struct SparseExtentHeader *
+vmdkheader(const struct vmdk *v)
+{
+	return &v->h;
+}
+
+static struct vmdkdec *
+decget(struct vmdk *v)
+{
+	struct vmdkdec *d;
+
+	if ((d = v->dec) != NULL) {
+		v->dec = d->next;
+		return d;
+	}
+	if ((d = calloc(1, sizeof *d)) == NULL)
+		return NULL;
+	if ((d->grain = malloc(v->grainsz)) == NULL ||
+	    inflateInit(&d->strm) != Z_OK) {
+		free(d->grain);
+		free(d);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return d;
+}
+
+static void
+decput(struct vmdk *v, struct vmdkdec *d)
+{
+	d->next = v->dec;
+	v->dec = d;
+}
+
+/*
+ * Decode the grain whose GTE is 'gte' into d->grain.  Compressed grains
+ * are preceded by their LBA and size, with or without the rest of a
+ * marker.
+ */
+static int
+decode(const struct vmdk *v, struct vmdkdec *d, uint32_t gte)
+{
+	struct Marker m;
+	off_t pos;
+	size_t want;
+
+	pos = (off_t)gte * SECTORSZ;
+	if (!(v->h.flags & FLAGBIT_COMPRESSED))
+		return readall(v->fd, d->grain, v->grainsz, pos);
+
+	if (readall(v->fd, &m, 12, pos) == -1)
+		return -1;
+	if (m.size == 0 || m.size > v->grainsz * 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	want = m.size;
+	if (d->bufsz < want) {
+		free(d->buf);
+		if ((d->buf = malloc(want)) == NULL) {
+			d->bufsz = 0;
+			return -1;
+		}
+		d->bufsz = want;
+	}
+	if (readall(v->fd, d->buf, want, pos + 12) == -1)
+		return -1;
+
+	if (v->h.compressAlgorithm == COMPRESSION_NONE) {
+		if (want != v->grainsz) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(d->grain, d->buf, want);
+		return 0;
+	}
+	if (inflateReset(&d->strm) != Z_OK)
+		return -1;
+	d->strm.next_in = d->buf;
+	d->strm.avail_in = want;
+	d->strm.next_out = d->grain;
+	d->strm.avail_out = v->grainsz;
+	if (inflate(&d->strm, Z_FINISH) != Z_STREAM_END ||
+	    d->strm.avail_out != 0) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static struct vmdkgrain *
+cachefind(struct vmdk *v, SectorType n)
+{
+	struct vmdkgrain *g;
+
+	for (g = v->hash[n & (v->hashsz - 1)]; g; g = g->hnext)
+		if (g->n == n) {
+			lruunlink(v, g);
+			lrufront(v, g);
+			return g;
+		}
+	return NULL;
+}
+
+/*
+ * Put the grain decoded by 'd' in the least recently used entry, giving
+ * 'd' that entry's buffer in exchange.
+ */
+static struct vmdkgrain *
+cacheadd(struct vmdk *v, SectorType n, struct vmdkdec *d)
+{
+	struct vmdkgrain *g, **gp;
+	unsigned char *data;
+
+	g = v->tail;
+	lruunlink(v, g);
+	if (g->n != NOGRAIN) {
+		for (gp = v->hash + (g->n & (v->hashsz - 1)); *gp != g;
+		    gp = &(*gp)->hnext)
+			;
+		*gp = g->hnext;
+	}
+	data = g->data;
+	g->data = d->grain;
+	d->grain = data;
+	g->n = n;
+	gp = v->hash + (n & (v->hashsz - 1));
+	g->hnext = *gp;
+	*gp = g;
+	lrufront(v, g);
+	return g;
+}
+
+/*
+ * Read 'len' bytes from offset 'off' of the disk.  Like pread(2), fewer
+ * bytes are returned at the end of the disk.  Calls on the same vmdk from
+ * several threads are safe, and only the cache lookups are serialised, so
+ * grains are decoded in parallel.
+ */
+ssize_t
+vmdkpread(struct vmdk *v, void *buf, size_t len, off_t off)
+{
+	struct vmdkgrain *g;
+	struct vmdkdec *d;
+	unsigned char *p;
+	SectorType n;
+	size_t o, sz;
+	ssize_t done;
+	uint32_t gte;
+	int err;
+
+	if (off < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((uint64_t)off >= v->size)
+		return 0;
+	if (len > v->size - off)
+		len = v->size - off;
+
+	for (p = buf, done = 0; len; p += sz, off += sz, len -= sz) {
+		n = off / v->grainsz;
+		o = off % v->grainsz;
+		sz = v->grainsz - o;
+		if (sz > len)
+			sz = len;
+		if ((gte = v->map.gt[n]) <= 1) {
+			memset(p, '\0', sz);
+			done += sz;
+			continue;
+		}
+
+		pthread_mutex_lock(&v->lock);
+		if ((g = cachefind(v, n)) == NULL) {
+			if ((d = decget(v)) == NULL) {
+				pthread_mutex_unlock(&v->lock);
+				return -1;
+			}
+			pthread_mutex_unlock(&v->lock);
+			err = decode(v, d, gte) == -1 ? errno : 0;
+			pthread_mutex_lock(&v->lock);
+			if (err) {
+				decput(v, d);
+				pthread_mutex_unlock(&v->lock);
+				errno = err;
+				return -1;
+			}
+			/* Another thread may have decoded it meanwhile */
+			if ((g = cachefind(v, n)) == NULL)
+				g = cacheadd(v, n, d);
+			decput(v, d);
+		}
+		memcpy(p, g->data + o, sz);
+		pthread_mutex_unlock(&v->lock);
+		done += sz;
+	}
+
+	return done;
+}
+
+/*
+ * Copy grain 'n' into 'buf' as it's stored in the extent, without the LBA
+ * and size in front of compressed grains.  Returns its length, or 0 if the
+ * grain isn't allocated.
+ */
+ssize_t
+vmdkgrain(struct vmdk *v, uint64_t n, void *buf, size_t sz)
+{
+	struct Marker m;
+	uint32_t gte;
+	size_t len;
+	off_t pos;
+
+	if (n >= v->map.grains) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((gte = v->map.gt[n]) <= 1)
+		return 0;
+
+	pos = (off_t)gte * SECTORSZ;
+	len = v->grainsz;
+	if (v->h.flags & FLAGBIT_COMPRESSED) {
+		if (readall(v->fd, &m, 12, pos) == -1)
+			return -1;
+		len = m.size;
+		pos += 12;
+	}
+	if (len > sz) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (readall(v->fd, buf, len, pos) == -1)
+		return -1;
+	return len;
+}
+
+void
+vmdkclose(struct vmdk *v)
+{
+	struct vmdkdec *d;
+	unsigned n;
+
+	while ((d = v->dec) != NULL) {
+		v->dec = d->next;
+		inflateEnd(&d->strm);
+		free(d->grain);
+		free(d->buf);
+		free(d);
+	}
+	for (n = 0; n < v->ngrains; n++)
+		free(v->grain[n].data);
+	free(v->grain);
+	free(v->hash);
+	vmdkfreemap(&v->map);
+	pthread_mutex_destroy(&v->lock);
+	close(v->fd);
+	free(v);
+}
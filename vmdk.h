@@ -0,0 +1,50 @@
+/*-
+ * Copyright (c) 2026 The vmdktool authors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * libvmdk, a small library for random access reads of hosted sparse VMDK
+ * extents.  vmdkopen() loads the grain directory and tables once, and
+ * vmdkpread() then reads from any offset of the disk, keeping a bounded
+ * LRU cache of 'grains' decoded grains, or VMDK_CACHEGRAINS if that's 0.
+ * Functions return NULL or -1 and set errno on failure.
+ */
+
+#ifndef VMDK_H
+#define VMDK_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define VMDK_CACHEGRAINS	64		/* default vmdkopen() cache */
+
+struct vmdk;
+
+struct vmdk *vmdkopen(const char *, unsigned);
+uint64_t vmdksize(const struct vmdk *);
+ssize_t vmdkpread(struct vmdk *, void *, size_t, off_t);
+void vmdkclose(struct vmdk *);
+
+#endif
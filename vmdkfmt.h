@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2026 The vmdktool authors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The hosted sparse extent format, as described in VMware Inc., Virtual
+ * Disk Format 1.1, and the parts of libvmdk that vmdktool uses but that
+ * aren't installed with vmdk.h.
+ */
+
+typedef uint64_t SectorType;
+typedef uint8_t Bool;
+
+struct SparseExtentHeader {
+	uint32_t	magicNumber;
+	uint32_t	version;
+	uint32_t	flags;
+	SectorType	capacity;
+	SectorType	grainSize;
+	SectorType	descriptorOffset;
+	SectorType	descriptorSize;
+	uint32_t	numGTEsPerGT;
+	SectorType	rgdOffset;
+	SectorType	gdOffset;
+	SectorType	overHead;
+	Bool		uncleanShutdown;
+	char		singleEndLineChar;
+	char		nonEndLineChar;
+	char		doubleEndLineChar1;
+	char		doubleEndLineChar2;
+	uint16_t	compressAlgorithm;
+	uint8_t		pad[432];
+	uint8_t		streamoptimized;	/* Not part of the spec */
+} __attribute__((__packed__));
+
+struct Marker {
+	SectorType	val;
+	uint32_t	size;
+	union {
+		uint32_t	type;
+		uint8_t		data[500];
+	} u;
+} __attribute__((__packed__));
+
+#define VMDK_MAGIC	(('V' << 24) | ('M' << 16) | ('D' << 8) | 'K')
+
+#define COMPRESSION_NONE	0
+#define COMPRESSION_DEFLATE	1
+
+#define MARKER_EOS		0
+#define MARKER_GT		1
+#define MARKER_GD		2
+#define MARKER_FOOTER		3
+
+#define FLAGBIT_NL		(1 << 0)
+#define FLAGBIT_RGT		(1 << 1)
+#define FLAGBIT_ZGGTE		(1 << 2)
+#define FLAGBIT_COMPRESSED	(1 << 16)
+#define FLAGBIT_MARKERS		(1 << 17)
+#define SECTORSZ		512
+
+/*
+ * The grain directory and every grain table it references.  gt[] holds
+ * whole grain tables and is indexed by grain number; grains in
+ * unallocated tables are 0.
+ */
+struct vmdkmap {
+	uint32_t	*gd;
+	uint32_t	*gt;
+	SectorType	gdsecs;		/* Sectors in the grain directory */
+	SectorType	gdents;		/* Entries in the grain directory */
+	SectorType	grains;
+};
+
+int vmdkfooter(int, off_t, struct SparseExtentHeader *);
+int vmdkloadmap(int, const struct SparseExtentHeader *, struct vmdkmap *);
+void vmdkfreemap(struct vmdkmap *);
+
+const struct SparseExtentHeader *vmdkheader(const struct vmdk *);
+ssize_t vmdkgrain(struct vmdk *, uint64_t, void *, size_t);
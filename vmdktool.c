@@ -24,122 +24,366 @@
  * SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* For SEEK_DATA and SEEK_HOLE */
+#endif
+
 struct mmsghdr;		/* XXX: Why do you make me do this linux? */
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #ifndef __APPLE__
 #include <getopt.h>
 #endif
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#define ZLIB_CONST
 #include <zlib.h>
 
 #include "expand_number.h"
+#include "sha256.h"
+#include "uring.h"
+#include "vmdk.h"
+#include "vmdkfmt.h"
+#include "nbd.h"
 
 
-typedef uint64_t SectorType;
-typedef uint8_t Bool;
-
-struct SparseExtentHeader {
-	uint32_t	magicNumber;
-	uint32_t	version;
-	uint32_t	flags;
-	SectorType	capacity;
-	SectorType	grainSize;
-	SectorType	descriptorOffset;
-	SectorType	descriptorSize;
-	uint32_t	numGTEsPerGT;
-	SectorType	rgdOffset;
-	SectorType	gdOffset;
-	SectorType	overHead;
-	Bool		uncleanShutdown;
-	char		singleEndLineChar;
-	char		nonEndLineChar;
-	char		doubleEndLineChar1;
-	char		doubleEndLineChar2;
-	uint16_t	compressAlgorithm;
-	uint8_t		pad[432];
-	uint8_t		streamoptimized;	/* Not part of the spec */
-} __attribute__((__packed__));
-
-struct Marker {
-	SectorType	val;
-	uint32_t	size;
-	union {
-		uint32_t	type;
-		uint8_t		data[500];
-	} u;
-} __attribute__((__packed__));
-
-#define VMDK_MAGIC	(('V' << 24) | ('M' << 16) | ('D' << 8) | 'K')
-
-#define COMPRESSION_NONE	0
-#define COMPRESSION_DEFLATE	1
-
-#define MARKER_EOS		0
-#define MARKER_GT		1
-#define MARKER_GD		2
-#define MARKER_FOOTER		3
-
-#define FLAGBIT_NL		(1 << 0)
-#define FLAGBIT_RGT		(1 << 1)
-#define FLAGBIT_ZGGTE		(1 << 2)
-#define FLAGBIT_COMPRESSED	(1 << 16)
-#define FLAGBIT_MARKERS		(1 << 17)
-#define SECTORSZ		512
-
 #define SET_VMDKVER		3
-#define SET_GRAINSZ		0x80UL		/* 64KB grains */
+#define SET_GRAINSZ		0x80UL		/* 64KB grains by default */
 #define SET_GTESPERGT		512		/* grain tables are 4 blocks */
+#define MIN_GRAINSZ		0x8UL		/* -g limits */
+#define MAX_GRAINSZ		0x800UL
+#define MIN_GTESPERGT		128		/* -G limits */
+#define MAX_GTESPERGT		512
 #define DEFLATE_STRENGTH	6
+#define INFLIGHT_PER_THREAD	4		/* default grains in flight (-j) */
+#define NBD_THREADS		4		/* default workers for -n */
+#define VERIFY_THREADS		4		/* default workers for -C */
+#define URING_WBUFS		16		/* grains queued by -r/-s (-U) */
+#define URING_OBUFS		4		/* output buffers queued by -v */
+#define URING_RAGRAINS		32		/* grains read ahead by -v */
+#define DIRECT_ALIGN		4096		/* O_DIRECT I/O alignment (-O) */
+#define CACHE_WINDOW		(32 * 1024 * 1024) /* cache kept by -N/-O */
 
 #define MIN_HEADER_OVERHEAD	0x80
+#define SPARSE_DESCSECS		20		/* descriptor space with -m */
+
+/* How -v writes a VMDK */
+struct writeopts {
+	uint64_t	capacity;	/* 0 => the size of the input */
+	int		zstrength;
+	int		threads;
+	unsigned	inflight;	/* Grains held in memory with -j */
+	int		zggte;		/* Give all-zero grains a GTE of 1 */
+	int		adaptive;	/* Store grains that won't compress */
+	unsigned	rate;		/* Target MB/s, 0 => no target */
+	int		stream;		/* Write sequentially; needs capacity */
+	int		dedup;		/* Store identical grains once */
+	int		sparse;		/* Write monolithicSparse (-m) */
+	const char	*extent;	/* Our file name, for the descriptor */
+};
 
 static int diag;
+static int useuring;		/* -U: Queue I/O on an io_uring */
+
+/*
+ * The grain size of the conversion, from -g or the VMDK being read, and the
+ * GTEs per grain table that -v writes (-G).
+ */
+static SectorType grainsecs = SET_GRAINSZ;
+static uint32_t gtespergt = SET_GTESPERGT;
+
+#define CACHE_DROP	1		/* -N: Drop what we've done from cache */
+#define CACHE_DIRECT	2		/* -O: Bypass the cache where we can */
+static int cachemode;
+
+/*
+ * Conversion statistics for -S.  Counters are updated atomically as -j
+ * threads share them; the timers are summed over all threads.
+ */
+#define ST_READ		0
+#define ST_DEFLATE	1
+#define ST_INFLATE	2
+#define ST_WRITE	3
+#define ST_SORT		4
+#define ST_TIMERS	5
+#define ST_BUCKETS	9		/* <= 1, 2, 4 ... 128 sectors, more */
+
+#define STATS_TEXT	1
+#define STATS_JSON	2
+
+static struct stats {
+	uint64_t	ns[ST_TIMERS];
+	uint64_t	reads, writes;	/* System calls */
+	uint64_t	bytesin, bytesout;
+	uint64_t	grains;		/* The disk's size in grains */
+	uint64_t	done;		/* Grains converted so far */
+	uint64_t	allocated;	/* Grains with data */
+	uint64_t	zero;		/* Grains known to be all zeros */
+	uint64_t	avoided;	/* Backward input seeks -r avoided */
+	uint64_t	deduped;	/* Grains that -D didn't write again */
+	uint64_t	dedupbytes;	/* ... and the bytes that saved */
+	uint64_t	reused;		/* Grains copied from the -I reference */
+	struct nbdstats	nbd;		/* Reads served by -n */
+	uint64_t	hist[ST_BUCKETS];	/* Compressed grain sizes */
+} stats;
+static int statfmt;
+
+static uint64_t
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+stattime(void)
+{
+	return statfmt ? monotime() : 0;
+}
+
+static void
+statadd(uint64_t *ctr, uint64_t n)
+{
+	__atomic_add_fetch(ctr, n, __ATOMIC_RELAXED);
+}
+
+static void
+stattimer(int t, uint64_t start)
+{
+	if (statfmt)
+		statadd(stats.ns + t, stattime() - start);
+}
+
+/* Count an allocated grain taking 'bytes' on disk, marker included */
+static void
+statgrain(uint64_t bytes)
+{
+	uint64_t secs;
+	int b;
+
+	secs = (bytes + SECTORSZ - 1) / SECTORSZ;
+	for (b = 0; b < ST_BUCKETS - 1 && secs > 1ULL << b; b++)
+		;
+	statadd(stats.hist + b, 1);
+	statadd(&stats.allocated, 1);
+}
 
 static int
 usage(void)
 {
-	fprintf(stderr, "usage: vmdktool [-di] [-r fn1.raw] [-s fn2.raw] "
-	    "[-t sec]\n");
-	fprintf(stderr, "                [[-c size] [-z zstr] -v fn3.vmdk] "
-	    "file\n");
+	fprintf(stderr, "usage: vmdktool [-diMNOPU] [-j threads] [-p secs] "
+	    "[-r fn1.raw] [-S fmt]\n");
+	fprintf(stderr, "                [-s fn2.raw] [-t sec] [[-ADmZ] [-c size] "
+	    "[-G gtes] [-g size]\n");
+	fprintf(stderr, "                [-I ref.vmdk] [-q grains] [-T rate] "
+	    "[-z zstr] -v fn3.vmdk] file\n");
+	fprintf(stderr, "       vmdktool [-d] [-j threads] [-q grains] "
+	    "[-S fmt] -n sock file\n");
+	fprintf(stderr, "       vmdktool [-d] [-o offset] [-S fmt] [-z zstr] "
+	    "-a patch.raw file\n");
+	fprintf(stderr, "       vmdktool [-d] [-j threads] [-p secs] "
+	    "[-q grains] [-S fmt] -C file\n");
 	fprintf(stderr, "       vmdktool -V\n");
+	fprintf(stderr, "       -A => Store grains that won't compress\n");
+	fprintf(stderr, "       -a => Write patch.raw into 'file' in place\n");
+	fprintf(stderr, "       -C => Check 'file' and show the SHA-256 of "
+	    "its contents\n");
 	fprintf(stderr, "       -c => Use disk capacity 'size' rather than "
 	    "the size of 'file'\n");
+	fprintf(stderr, "       -D => Write identical grains only once\n");
 	fprintf(stderr, "       -d => Increase diagnostics\n");
+	fprintf(stderr, "       -G => Write 'gtes' GTEs per grain table\n");
+	fprintf(stderr, "       -g => Write grains of 'size' bytes\n");
+	fprintf(stderr, "       -I => Copy unchanged grains from ref.vmdk\n");
 	fprintf(stderr, "       -i => Show vmdk info from 'file'\n");
+	fprintf(stderr, "       -j => Use 'threads' threads with -C, -n, -r "
+	    "or -v\n");
+	fprintf(stderr, "       -M => Map 'file' into memory with -r or -s\n");
+	fprintf(stderr, "       -m => Write a monolithicSparse vmdk with -v\n");
+	fprintf(stderr, "       -N => Don't leave 'file' or the output in the "
+	    "page cache\n");
+	fprintf(stderr, "       -n => Serve 'file' read-only over NBD on "
+	    "socket 'sock'\n");
+	fprintf(stderr, "       -o => Write the patch at byte 'offset' "
+	    "with -a\n");
+	fprintf(stderr, "       -O => Use direct I/O where possible, "
+	    "implies -N\n");
+	fprintf(stderr, "       -P => Preallocate the data written by -r\n");
+	fprintf(stderr, "       -p => Report progress every 'secs' seconds\n");
+	fprintf(stderr, "       -q => Hold at most 'grains' grains in memory "
+	    "with -C, -j or -n\n");
 	fprintf(stderr, "       -r => Read random vmdk data, "
 	    "write raw data to fn1.raw\n");
+	fprintf(stderr, "       -S => Show statistics as 'fmt' (text or json) "
+	    "at exit\n");
 	fprintf(stderr, "       -s => Read stream vmdk data, "
 	    "write raw data to fn2.raw\n");
+	fprintf(stderr, "       -T => Adjust the deflate strength to convert "
+	    "at 'rate' MB/s\n");
 	fprintf(stderr, "       -t => Show vmdk table info at sector 'sec'\n");
+	fprintf(stderr, "       -U => Queue I/O on an io_uring (linux)\n");
 	fprintf(stderr, "       -V => Show the version number and exit\n");
 	fprintf(stderr, "       -v => Read raw data, write vmdk data to "
 	    "fn3.vmdk\n");
+	fprintf(stderr, "       -Z => Write zero-grain GTEs for empty grains\n");
 	fprintf(stderr, "       -z => Set the deflate strength to 'zstr'\n");
 	fprintf(stderr, "       file => A raw disk or vmdk image\n");
 
 	return 1;
 }
 
+/*
+ * With -O, the input and output are also opened with O_DIRECT (or
+ * F_NOCACHE) and iofd() picks that descriptor for I/O that is suitably
+ * aligned.  Everything else, such as headers and grain tables, goes through
+ * the descriptor the rest of the code knows about.  With -N or -O, the
+ * cached pages of both are dropped every CACHE_WINDOW bytes, so the cache
+ * used stays bounded however large the image is.
+ */
+static struct cachefile {
+	int		fd;		/* -1 if not in use */
+	int		dfd;		/* The O_DIRECT twin, or -1 */
+	int		writing;
+	uint64_t	bytes;		/* Bytes transferred so far */
+} cachefile[2] = { { -1, -1, 0, 0 }, { -1, -1, 0, 0 } };
+
+static struct cachefile *
+cachefind(int fd)
+{
+	unsigned n;
+
+	if (fd >= 0)
+		for (n = 0; n < sizeof cachefile / sizeof *cachefile; n++)
+			if (cachefile[n].fd == fd)
+				return cachefile + n;
+	return NULL;
+}
+
+static void
+cacheinit(int fd, const char *path, int writing, int sequential)
+{
+	struct cachefile *c;
+
+	if (!cachemode)
+		return;
+	c = cachefile[0].fd == -1 ? cachefile : cachefile + 1;
+	assert(c->fd == -1);
+	c->fd = fd;
+	c->dfd = -1;
+	c->writing = writing;
+	c->bytes = 0;
+	if (cachemode & CACHE_DIRECT) {
+#if defined(O_DIRECT)
+		c->dfd = open(path, (writing ? O_WRONLY : O_RDONLY) | O_DIRECT);
+#elif defined(F_NOCACHE)
+		if ((c->dfd = open(path, writing ? O_WRONLY : O_RDONLY)) != -1 &&
+		    fcntl(c->dfd, F_NOCACHE, 1) == -1) {
+			close(c->dfd);
+			c->dfd = -1;
+		}
+#else
+		errno = EOPNOTSUPP;
+#endif
+		if (c->dfd == -1 && diag)
+			printf("%s: direct I/O: %s, using the cache\n", path,
+			    strerror(errno));
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (sequential)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/*
+ * Which descriptor should transfer 'n' bytes between 'buf' and offset
+ * 'pos' of 'fd'?
+ */
+static int
+iofd(int fd, const void *buf, size_t n, off_t pos)
+{
+	struct cachefile *c;
+
+	if ((c = cachefind(fd)) == NULL || c->dfd == -1 ||
+	    (((uintptr_t)buf | n | (uint64_t)pos) & (DIRECT_ALIGN - 1)))
+		return fd;
+	return c->dfd;
+}
+
+static int
+cachedirect(int fd)
+{
+	struct cachefile *c;
+
+	return (c = cachefind(fd)) != NULL && c->dfd != -1;
+}
+
+static void
+cachedrop(struct cachefile *c)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (c->writing && fdatasync(c->fd) == -1)
+		perror("fdatasync");
+	posix_fadvise(c->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* Account for 'n' bytes transferred, dropping the cache now and again */
+static void
+cachedone(int fd, size_t n)
+{
+	struct cachefile *c;
+	uint64_t was;
+
+	if (!cachemode || (c = cachefind(fd)) == NULL)
+		return;
+	was = __atomic_fetch_add(&c->bytes, n, __ATOMIC_RELAXED);
+	if (was / CACHE_WINDOW != (was + n) / CACHE_WINDOW)
+		cachedrop(c);
+}
+
+static void
+cacheend(int fd)
+{
+	struct cachefile *c;
+
+	if ((c = cachefind(fd)) == NULL)
+		return;
+	cachedrop(c);
+	if (c->dfd != -1)
+		close(c->dfd);
+	c->fd = c->dfd = -1;
+}
+
 static void
 awrite(int fd, const void *buf, size_t n, const char *what)
 {
+	uint64_t start;
 	ssize_t got;
 	off_t pos;
 
 	pos = diag > 1 ? lseek(fd, 0, SEEK_CUR) : 0;
+	start = stattime();
 	got = write(fd, buf, n);
+	stattimer(ST_WRITE, start);
+	statadd(&stats.writes, 1);
 	if (got == -1) {
 		perror("write");
 		abort();
@@ -147,21 +391,74 @@ awrite(int fd, const void *buf, size_t n, const char *what)
 		fprintf(stderr, "write: tried %lu, got %ld\n", (long unsigned)n, (long)got);
 		abort();
 	}
+	statadd(&stats.bytesout, n);
+	cachedone(fd, n);
+	if (diag > 1)
+		printf("Wrote %s of %lu bytes at offset 0x%llx\n",
+		    what, (unsigned long)n, (unsigned long long)pos);
+}
+
+static void
+apwrite(int fd, const void *buf, size_t n, off_t pos, const char *what)
+{
+	uint64_t start;
+	ssize_t got;
+
+	start = stattime();
+	got = pwrite(iofd(fd, buf, n, pos), buf, n, pos);
+	stattimer(ST_WRITE, start);
+	statadd(&stats.writes, 1);
+	if (got == -1) {
+		perror("pwrite");
+		abort();
+	} else if (got != (ssize_t)n) {
+		fprintf(stderr, "pwrite: tried %lu, got %ld\n", (long unsigned)n, (long)got);
+		abort();
+	}
+	statadd(&stats.bytesout, n);
+	cachedone(fd, n);
 	if (diag > 1)
 		printf("Wrote %s of %lu bytes at offset 0x%llx\n",
 		    what, (unsigned long)n, (unsigned long long)pos);
 }
 
+static size_t
+apread(int fd, void *buf, size_t n, off_t pos)
+{
+	uint64_t start;
+	ssize_t got;
+
+	start = stattime();
+	got = pread(iofd(fd, buf, n, pos), buf, n, pos);
+	stattimer(ST_READ, start);
+	statadd(&stats.reads, 1);
+	if (got == -1) {
+		perror("pread");
+		abort();
+	}
+	statadd(&stats.bytesin, got);
+	cachedone(fd, got);
+	if (got != (ssize_t)n)
+		memset((char *)buf + got, '\0', n - got);
+	return got;
+}
+
 static size_t
 aread(int fd, void *buf, size_t n)
 {
+	uint64_t start;
 	ssize_t got;
 
+	start = stattime();
 	got = read(fd, buf, n);
+	stattimer(ST_READ, start);
+	statadd(&stats.reads, 1);
 	if (got == -1) {
 		perror("read");
 		abort();
 	}
+	statadd(&stats.bytesin, got);
+	cachedone(fd, got);
 	if (got != (ssize_t)n)
 		memset((char *)buf + got, '\0', n - got);
 	return got;
@@ -326,39 +623,322 @@ vmdkinfo(const char *fn, int fd, struct SparseExtentHeader *h, int showddb)
 	return 1;
 }
 
+/*
+ * Everything needed to (de)compress grains, set up once per thread so that
+ * nothing is allocated per grain.  Allocations made here and by zlib are
+ * counted and reported with -dd.
+ */
+struct zworker {
+	z_stream	strm;
+	int		deflating;
+	int		level;		/* Current deflate level */
+	unsigned char	*grain;		/* A grain of raw data */
+	unsigned char	*buf;		/* Compressed grain data */
+	size_t		bufsz;
+	unsigned char	*ref;		/* A grain of the -I reference */
+};
+
+static unsigned long nallocs;
+
+static void *
+countalloc(size_t sz)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return malloc(sz);
+}
+
+static void *
+countrealloc(void *p, size_t sz)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return realloc(p, sz);
+}
+
+/* Buffers that may be used for direct I/O are page aligned */
+static void *
+alignalloc(size_t sz)
+{
+	void *p;
+
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return posix_memalign(&p, getpagesize(), sz) == 0 ? p : NULL;
+}
+
+static voidpf
+zcountalloc(voidpf opaque __attribute__((__unused__)), uInt items, uInt size)
+{
+	return countalloc((size_t)items * size);
+}
+
+static void
+zcountfree(voidpf opaque __attribute__((__unused__)), voidpf ptr)
+{
+	free(ptr);
+}
+
+/*
+ * Prepare to deflate at strength 'zstrength', or to inflate if it's -1.
+ * 'grainsz' and 'bufsz' size the working buffers, either of which may be 0.
+ */
+static void
+zinit(struct zworker *zw, int zstrength, size_t grainsz, size_t bufsz)
+{
+	memset(zw, '\0', sizeof *zw);
+	zw->strm.zalloc = zcountalloc;
+	zw->strm.zfree = zcountfree;
+	zw->deflating = zstrength != -1;
+	zw->level = zstrength;
+	if (zw->deflating)
+		assert(deflateInit(&zw->strm, zstrength) == Z_OK);
+	else
+		assert(inflateInit(&zw->strm) == Z_OK);
+	if (grainsz)
+		assert(zw->grain = alignalloc(grainsz));
+	if ((zw->bufsz = bufsz) != 0)
+		assert(zw->buf = countalloc(bufsz));
+}
+
+static void
+zend(struct zworker *zw)
+{
+	if (zw->deflating)
+		deflateEnd(&zw->strm);
+	else
+		inflateEnd(&zw->strm);
+	free(zw->grain);
+	free(zw->buf);
+	free(zw->ref);
+}
+
+/*
+ * With -U, writes are queued on an io_uring from a small set of buffers so
+ * that the caller can carry on filling another buffer while earlier ones
+ * are written.  A buffer is handed out again once its write completes.
+ */
+struct wq {
+	struct ioq	*q;
+	int		fd;
+	unsigned	nbufs;
+	unsigned char	**buf;
+	size_t		*len;		/* Bytes being written, 0 if free */
+	off_t		*pos;
+};
+
+/*
+ * Returns 0 if there's no io_uring to be had, in which case the caller
+ * should write synchronously.
+ */
+static int
+wqinit(struct wq *w, int fd, unsigned nbufs, size_t bufsz)
+{
+	unsigned n;
+
+	memset(w, '\0', sizeof *w);
+	if ((w->q = ioqopen(nbufs)) == NULL) {
+		if (diag)
+			printf("io_uring: %s, using synchronous I/O\n",
+			    strerror(errno));
+		return 0;
+	}
+	w->fd = fd;
+	w->nbufs = nbufs;
+	assert(w->buf = countalloc(nbufs * sizeof *w->buf));
+	assert(w->len = calloc(nbufs, sizeof *w->len));
+	assert(w->pos = calloc(nbufs, sizeof *w->pos));
+	for (n = 0; n < nbufs; n++)
+		assert(w->buf[n] = alignalloc(bufsz));
+	return 1;
+}
+
+/* Wait for a queued write to complete and free its buffer */
+static void
+wqreap(struct wq *w)
+{
+	uint64_t slot;
+	ssize_t res;
+
+	assert(ioqwait(w->q, &slot, &res) == 0);
+	if (res < 0) {
+		errno = -res;
+		perror("pwrite");
+		abort();
+	}
+	statadd(&stats.bytesout, res);
+	cachedone(w->fd, res);
+	if ((size_t)res < w->len[slot])		/* Unlikely, finish it here */
+		apwrite(w->fd, w->buf[slot] + res, w->len[slot] - res,
+		    w->pos[slot] + res, "the rest of a queued write");
+	w->len[slot] = 0;
+}
+
+static unsigned char *
+wqget(struct wq *w, unsigned *slot)
+{
+	unsigned n;
+
+	for (;;) {
+		for (n = 0; n < w->nbufs; n++)
+			if (!w->len[n]) {
+				*slot = n;
+				return w->buf[n];
+			}
+		wqreap(w);
+	}
+}
+
+static void
+wqput(struct wq *w, unsigned slot, size_t len, off_t pos, const char *what)
+{
+	if (!len)
+		return;
+	w->len[slot] = len;
+	w->pos[slot] = pos;
+	ioqwrite(w->q, iofd(w->fd, w->buf[slot], len, pos), w->buf[slot], len,
+	    pos, slot);
+	ioqsubmit(w->q);	/* Start it now, while the next is prepared */
+	if (diag > 1)
+		printf("Queued %s of %lu bytes at offset 0x%llx\n",
+		    what, (unsigned long)len, (unsigned long long)pos);
+}
+
+/* Wait for any queued write to 'pos' to complete */
+static void
+wqsettle(struct wq *w, off_t pos)
+{
+	unsigned n;
+
+	for (n = 0; n < w->nbufs; n++)
+		while (w->len[n] && w->pos[n] == pos)
+			wqreap(w);
+}
+
+static void
+wqend(struct wq *w)
+{
+	unsigned n;
+
+	for (n = 0; n < w->nbufs; n++)
+		while (w->len[n])
+			wqreap(w);
+	for (n = 0; n < w->nbufs; n++)
+		free(w->buf[n]);
+	free(w->buf);
+	free(w->len);
+	free(w->pos);
+	ioqclose(w->q);
+}
+
+/*
+ * With -M the whole input is mapped into memory and grains are inflated
+ * straight from the mapping rather than being read into a buffer first.
+ */
+static struct inmap {
+	const unsigned char *base;	/* NULL unless mapped */
+	off_t		size;
+} inmap;
+
+/*
+ * Return the marker at offset 'pos' of the mapped input, or NULL if the
+ * input isn't mapped or the marker's data runs beyond it.
+ */
+static const struct Marker *
+mappedmarker(off_t pos)
+{
+	const struct Marker *m;
+
+	if (inmap.base == NULL || pos < 0 ||
+	    pos + (off_t)sizeof *m > inmap.size)
+		return NULL;
+	m = (const struct Marker *)(inmap.base + pos);
+	if (pos + 12 + (off_t)m->size > inmap.size)
+		return NULL;
+	return m;
+}
+
+/*
+ * Map 'size' bytes of 'fd' for -M, telling the kernel how we'll use them.
+ * If the mapping fails we fall back to reading.
+ */
+static void
+mapinput(int fd, off_t size, int advice)
+{
+	void *p;
+
+	if ((uint64_t)size > SIZE_MAX ||
+	    (p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+	if (madvise(p, size, advice) == -1 && diag)
+		perror("madvise");
+	inmap.base = p;
+	inmap.size = size;
+	if (diag > 1)
+		printf("Mapped %llu bytes of input\n", (unsigned long long)size);
+}
+
+static void
+unmapinput(void)
+{
+	if (inmap.base) {
+		munmap((void *)(uintptr_t)inmap.base, inmap.size);
+		inmap.base = NULL;
+	}
+}
+
+/*
+ * Decode the grain described by marker 'm' into zw->grain.  If 'mapped', 'm'
+ * came from mappedmarker() and its data follows it in memory.  Otherwise
+ * any data beyond the marker's first sector is read from offset 'pos' of
+ * 'ifd', or from the current position if 'pos' is -1.
+ */
 static void
 marker2grain(int ifd, const struct SparseExtentHeader *h,
-    const struct Marker *m, unsigned char *grain, unsigned char **buf, size_t *bufsz)
+    const struct Marker *m, struct zworker *zw, off_t pos, int mapped)
 {
-	z_stream strm;
+	const unsigned char *data;
+	uint64_t start;
+	z_stream *strm;
 	ssize_t want;
 
 	want = m->size + 12;
 	if (want % SECTORSZ)
 		want = (want / SECTORSZ + 1) * SECTORSZ;
-	if (*bufsz < (size_t)want - 12) {
-		*bufsz = want - 12;
-		assert(*buf = realloc(*buf, *bufsz));
-	}
-	memcpy(*buf, &m->u, 500);
-	if (want > SECTORSZ) {
-		aread(ifd, *buf + 500, want - SECTORSZ);
-		if (diag > 1)
-			printf("Read an extra %lu bytes\n", (unsigned long)want - SECTORSZ);
+	statgrain(want);
+	if (mapped)
+		data = m->u.data;
+	else {
+		if (zw->bufsz < (size_t)want - 12) {
+			zw->bufsz = want - 12;
+			assert(zw->buf = countrealloc(zw->buf, zw->bufsz));
+		}
+		memcpy(zw->buf, &m->u, 500);
+		if (want > SECTORSZ) {
+			if (pos == -1)
+				aread(ifd, zw->buf + 500, want - SECTORSZ);
+			else
+				apread(ifd, zw->buf + 500, want - SECTORSZ,
+				    pos);
+			if (diag > 1)
+				printf("Read an extra %lu bytes\n",
+				    (unsigned long)want - SECTORSZ);
+		}
+		data = zw->buf;
 	}
 
 	if ((h->flags & FLAGBIT_COMPRESSED) &&
 	    h->compressAlgorithm == COMPRESSION_DEFLATE) {
-		memset(&strm, '\0', sizeof strm);
-		assert(inflateInit(&strm) == Z_OK);
-		strm.avail_in = m->size;
-		strm.next_in = *buf;
-		strm.avail_out = h->grainSize * SECTORSZ;
-		strm.next_out = grain;
-		assert(inflate(&strm, Z_FINISH) == Z_STREAM_END);
-		assert(strm.avail_in == 0);
-		assert(strm.avail_out == 0);
-		inflateEnd(&strm);
+		strm = &zw->strm;
+		assert(inflateReset(strm) == Z_OK);
+		strm->avail_in = m->size;
+		strm->next_in = data;
+		strm->avail_out = h->grainSize * SECTORSZ;
+		strm->next_out = zw->grain;
+		start = stattime();
+		assert(inflate(strm, Z_FINISH) == Z_STREAM_END);
+		stattimer(ST_INFLATE, start);
+		assert(strm->avail_in == 0);
+		assert(strm->avail_out == 0);
 		if (diag > 1)
 			printf("INFLATEd grain from %lu to %llu\n",
 			    (unsigned long)m->size,
@@ -366,7 +946,7 @@ marker2grain(int ifd, const struct SparseExtentHeader *h,
 	} else if (!(h->flags & FLAGBIT_COMPRESSED) ||
 	    h->compressAlgorithm == COMPRESSION_NONE) {
 		assert(m->size == h->grainSize * SECTORSZ);
-		memcpy(grain, *buf, m->size);
+		memcpy(zw->grain, data, m->size);
 	}
 }
 
@@ -375,21 +955,72 @@ dirblks(const struct SparseExtentHeader *h)
 {
 	SectorType blks;
 
-	blks = h->capacity * SECTORSZ;
-	blks = blks / h->grainSize + (blks % h->grainSize ? 1 : 0);
+	blks = h->capacity / h->grainSize +
+	    (h->capacity % h->grainSize ? 1 : 0);
 	blks = blks / h->numGTEsPerGT + (blks % h->numGTEsPerGT ? 1 : 0);
 	blks *= sizeof(uint32_t);
-	blks = blks / SECTORSZ + (blks % h->numGTEsPerGT ? 1 : 0);
-	if (blks % SECTORSZ)
-		blks += SECTORSZ;
-	blks /= SECTORSZ;
+	blks = blks / SECTORSZ + (blks % SECTORSZ ? 1 : 0);
 
 	return blks;
 }
 
+/*
+ * Load the grain map (see vmdk.h) once so that grain lookups need no
+ * further I/O.
+ */
+static int
+loadgrainmap(int ifd, const struct SparseExtentHeader *h,
+    struct vmdkmap *map)
+{
+	SectorType n, tables;
+	size_t mem;
+
+	if (vmdkloadmap(ifd, h, map) == -1)
+		return 0;
+
+	for (n = tables = 0; n < map->gdents; n++)
+		if (map->gd[n])
+			tables++;
+	mem = map->gdsecs * SECTORSZ +
+	    map->gdents * h->numGTEsPerGT * sizeof(uint32_t);
+	if (diag)
+		printf("Grain map: %llu of %llu grain tables allocated, "
+		    "%lu bytes of memory\n", (unsigned long long)tables,
+		    (unsigned long long)map->gdents, (unsigned long)mem);
+	return 1;
+}
+
+/*
+ * Fetch sector 'sec' of a grain directory or grain table, using the grain
+ * map if it holds that sector.
+ */
+static void
+tablesector(int fd, const struct SparseExtentHeader *h,
+    const struct vmdkmap *map, SectorType sec, char *block)
+{
+	SectorType gtsecs, n;
+
+	if (sec >= h->gdOffset && sec < h->gdOffset + map->gdsecs) {
+		memcpy(block, (char *)map->gd + (sec - h->gdOffset) * SECTORSZ,
+		    SECTORSZ);
+		return;
+	}
+
+	gtsecs = h->numGTEsPerGT * sizeof(uint32_t) / SECTORSZ;
+	for (n = 0; n < map->gdents; n++)
+		if (map->gd[n] && sec >= map->gd[n] &&
+		    sec < map->gd[n] + gtsecs) {
+			memcpy(block, (char *)(map->gt + n * h->numGTEsPerGT) +
+			    (sec - map->gd[n]) * SECTORSZ, SECTORSZ);
+			return;
+		}
+
+	apread(fd, block, SECTORSZ, sec * SECTORSZ);
+}
+
 static void
 vmdkshowtable(int fd, uint32_t pos, uint32_t type,
-    const struct SparseExtentHeader *h)
+    const struct SparseExtentHeader *h, const struct vmdkmap *map)
 {
 	char block[SECTORSZ];
 	const char *typestr;
@@ -412,9 +1043,13 @@ vmdkshowtable(int fd, uint32_t pos, uint32_t type,
 
 	printf("type GRAIN %s, %d sectors\n", typestr, blks);
 
-	lseek(fd, pos * SECTORSZ, SEEK_SET);
+	if (map == NULL)
+		lseek(fd, pos * SECTORSZ, SEEK_SET);
 	for (blk = 0; blk < blks; blk++) {
-		aread(fd, block, SECTORSZ);
+		if (map == NULL)
+			aread(fd, block, SECTORSZ);
+		else
+			tablesector(fd, h, map, pos + blk, block);
 		printf("   ");
 		for (n = 0; n < SECTORSZ / 4; n++) {
 			memcpy(&entry, block + n * 4, 4);
@@ -426,43 +1061,290 @@ vmdkshowtable(int fd, uint32_t pos, uint32_t type,
 	}
 }
 
+/*
+ * Zero detection runs over every grain we read, so it's done 128 bytes at a
+ * time using vector types, bailing out at the first non-zero block.  The
+ * same code is built for the baseline CPU and, on amd64, for AVX2, and
+ * zeroinit() picks the best one that the CPU supports.
+ */
+typedef uint64_t zvec __attribute__((__vector_size__(32)));
+
+#define GRAINEMPTY(name)						\
+static int								\
+name(const unsigned char *grain, size_t sz)				\
+{									\
+	zvec v[4];							\
+	size_t i;							\
+									\
+	for (i = 0; i + sizeof v <= sz; i += sizeof v) {		\
+		memcpy(v, grain + i, sizeof v);				\
+		v[0] |= v[1] | v[2] | v[3];				\
+		if (v[0][0] | v[0][1] | v[0][2] | v[0][3])		\
+			return 0;					\
+	}								\
+	for (; i < sz; i++)						\
+		if (grain[i])						\
+			return 0;					\
+	return 1;							\
+}
+
+GRAINEMPTY(grainempty_vec)
+#if defined(__x86_64__)
+#define HAVE_ZERO_AVX2
+__attribute__((__target__("avx2")))
+GRAINEMPTY(grainempty_avx2)
+#endif
+
+static int (*grainempty)(const unsigned char *, size_t) = grainempty_vec;
+
 static void
-vmdkparsestream(int ifd, struct SparseExtentHeader *h, int ofd)
+zeroinit(void)
 {
-	struct Marker *m;
-	unsigned char buf[sizeof *m], *grain, *dbuf;
-	SectorType mtblblks, mdirblks;
-	struct SparseExtentHeader f;
-	size_t dbufsz;
-	off_t pos;
-	int eos;
+	const char *how;
+
+	how = "baseline";
+#ifdef HAVE_ZERO_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		grainempty = grainempty_avx2;
+		how = "AVX2";
+	}
+#endif
+	if (diag > 1)
+		printf("Using %s zero grain detection\n", how);
+}
 
-	pos = lseek(ifd, 0, SEEK_CUR);
+/*
+ * Set when the raw output is a regular file, which starts out empty after
+ * O_TRUNC.  Anything else, such as a disk device, holds old data that zero
+ * grains have to overwrite.
+ */
+static int sparseout;
 
-	m = (struct Marker *)buf;
-	dbuf = NULL;
-	dbufsz = 0;
-	eos = 0;
-	mdirblks = dirblks(h);
-	mtblblks = h->numGTEsPerGT * sizeof(uint32_t) / SECTORSZ;
-	assert(grain = malloc(h->grainSize * SECTORSZ));
-	while (read(ifd, buf, sizeof buf) == sizeof buf) {
-		if (eos)
-			fprintf(stderr, "oops, more data after EOS...\n");
-		if (diag > 1)
-			printf("Pos 0x%llx (%llu): ", (unsigned long long)pos,
-			    (unsigned long long)pos);
+static int
+isregular(int fd)
+{
+	struct stat st;
+
+	assert(fstat(fd, &st) == 0);
+	return S_ISREG(st.st_mode);
+}
+
+/*
+ * Write an extracted grain to 'pos' of the raw output, from the wq buffer
+ * 'slot' if 'wq' is set.  When the output is sparse, grains that inflate
+ * to all zeros aren't written and are left as holes, unless they 'rewrite'
+ * a grain written earlier.
+ */
+static void
+grainout(int ofd, const unsigned char *grain, size_t sz, off_t pos,
+    struct wq *wq, unsigned slot, int rewrite)
+{
+	if (sparseout && !rewrite && grainempty(grain, sz)) {
+		if (diag > 1)
+			printf("Skipped zero grain at offset 0x%llx\n",
+			    (unsigned long long)pos);
+		return;
+	}
+	if (wq) {
+		/* The writes could otherwise complete in either order */
+		if (rewrite)
+			wqsettle(wq, pos);
+		wqput(wq, slot, sz, pos, "grain");
+	} else
+		apwrite(ofd, grain, sz, pos, "grain");
+}
+
+/*
+ * Write zeros over grain 'n' of output that isn't sparse, as the grain
+ * isn't allocated or is a zero grain.  'zeros' holds a grain of them.
+ */
+static void
+zeroout(int ofd, const struct SparseExtentHeader *h, SectorType n,
+    const unsigned char *zeros)
+{
+	SectorType secs;
+
+	secs = h->grainSize;
+	if ((n + 1) * secs > h->capacity)
+		secs = h->capacity - n * secs;
+	apwrite(ofd, zeros, secs * SECTORSZ, n * h->grainSize * SECTORSZ,
+	    "zero grain");
+}
+
+/*
+ * Extract grain 'n', whose GTE is 'gte', from a random access read of the
+ * input.
+ */
+static void
+grain2raw(int ifd, const struct SparseExtentHeader *h, uint32_t gte, int ofd,
+    SectorType n, struct zworker *zw, struct wq *wq)
+{
+	const struct Marker *mp;
+	unsigned char *grain;
+	struct Marker m;
+	SectorType blk;
+	unsigned slot;
+	size_t sz;
+
+	if ((blk = gte) <= 1) {
+		if (blk == 1)
+			statadd(&stats.zero, 1);
+		return;
+	}
+
+	blk *= SECTORSZ;
+	if (diag > 1)
+		printf("Pos 0x%llx (%llu): ", (unsigned long long)blk,
+		    (unsigned long long)blk);
+
+	/* Uncompressed grains are stored whole, without a marker */
+	if (!(h->flags & FLAGBIT_COMPRESSED)) {
+		sz = h->grainSize * SECTORSZ;
+		if (diag)
+			printf("type GRAIN, uncompressed\n");
+		statgrain(sz);
+		grain = zw->grain;
+		slot = 0;
+		if (wq)
+			grain = wqget(wq, &slot);
+		if (inmap.base && (off_t)(blk + sz) <= inmap.size)
+			memcpy(grain, inmap.base + blk, sz);
+		else
+			apread(ifd, grain, sz, blk);
+		grainout(ofd, grain, sz, n * sz, wq, slot, 0);
+		return;
+	}
+	if ((mp = mappedmarker(blk)) == NULL) {
+		apread(ifd, &m, sizeof m, blk);
+		mp = &m;
+	}
+	assert(mp->size);
+	if (diag)
+		printf("type GRAIN, %lu bytes of data, lba %llu\n",
+		    (unsigned long)mp->size, (unsigned long long)mp->val);
+	/* With -D, grains may be shared and the marker has the first LBA */
+	if (diag && mp->val != n * h->grainSize)
+		printf("Grain %llu shares that grain\n",
+		    (unsigned long long)n);
+
+	/* With -U, inflate straight into a write buffer to queue */
+	grain = zw->grain;
+	slot = 0;
+	if (wq)
+		zw->grain = wqget(wq, &slot);
+	marker2grain(ifd, h, mp, zw, blk + sizeof m, mp != &m);
+	grainout(ofd, zw->grain, h->grainSize * SECTORSZ,
+	    n * h->grainSize * SECTORSZ, wq, slot, 0);
+	zw->grain = grain;
+}
+
+/*
+ * A grain written with -D may be referenced by several GTEs, but its marker
+ * only carries the first LBA.  Once the grain directory at sector 'gdsec' is
+ * reached, every grain table is read back and any allocated grain that
+ * hasn't been 'seen' in the stream is extracted from where its GTE points
+ * and marked as seen.
+ */
+static void
+streamshared(int ifd, const struct SparseExtentHeader *h, SectorType gdsec,
+    SectorType gdsecs, unsigned char *seen, int ofd, struct zworker *zw)
+{
+	SectorType e, g, grains, n;
+	uint32_t *gd, *gt;
+	size_t gtsz;
+
+	grains = (h->capacity + h->grainSize - 1) / h->grainSize;
+	gtsz = h->numGTEsPerGT * sizeof(uint32_t);
+	assert(gd = malloc(gdsecs * SECTORSZ));
+	assert(gt = malloc(gtsz));
+	apread(ifd, gd, gdsecs * SECTORSZ, gdsec * SECTORSZ);
+	for (n = 0; n < gdsecs * SECTORSZ / sizeof *gd &&
+	    n * h->numGTEsPerGT < grains; n++) {
+		if (!gd[n])
+			continue;
+		apread(ifd, gt, gtsz, (off_t)gd[n] * SECTORSZ);
+		for (e = 0; e < h->numGTEsPerGT; e++) {
+			g = n * h->numGTEsPerGT + e;
+			if (g < grains && gt[e] > 1 &&
+			    !(seen[g / 8] & (1 << g % 8))) {
+				grain2raw(ifd, h, gt[e], ofd, g, zw, NULL);
+				seen[g / 8] |= 1 << g % 8;
+			}
+		}
+	}
+	free(gt);
+	free(gd);
+}
+
+static void
+vmdkparsestream(int ifd, struct SparseExtentHeader *h, int ofd)
+{
+	SectorType g, grains, mtblblks, mdirblks;
+	struct SparseExtentHeader f;
+	const struct Marker *m;
+	unsigned char *grain, *seen;
+	struct zworker zw;
+	struct wq wq, *wqp;
+	struct Marker buf;
+	int again, eos, mapped;
+	unsigned slot;
+	off_t pos;
+
+	pos = lseek(ifd, 0, SEEK_CUR);
+
+	eos = 0;
+	mdirblks = dirblks(h);
+	mtblblks = h->numGTEsPerGT * sizeof(uint32_t) / SECTORSZ;
+	zinit(&zw, -1, h->grainSize * SECTORSZ, 0);
+	wqp = useuring && wqinit(&wq, ofd, URING_WBUFS,
+	    h->grainSize * SECTORSZ) ? &wq : NULL;
+	grain = zw.grain;
+	slot = 0;
+	grains = (h->capacity + h->grainSize - 1) / h->grainSize;
+	assert(seen = calloc(1, grains / 8 + 1));
+	for (;;) {
+		if ((m = mappedmarker(pos)) != NULL) {
+			mapped = 1;
+			if (!m->size)	/* Tables & footers are still read */
+				lseek(ifd, pos + sizeof *m, SEEK_SET);
+		} else {
+			mapped = 0;
+			if (inmap.base)
+				lseek(ifd, pos, SEEK_SET);
+			if (aread(ifd, &buf, sizeof buf) != sizeof buf)
+				break;
+			m = &buf;
+		}
+		/* -a appends to a file after the EOS that used to end it */
+		if (eos && diag)
+			printf("More data after EOS, appended by -a\n");
+		eos = 0;
+		if (diag > 1)
+			printf("Pos 0x%llx (%llu): ", (unsigned long long)pos,
+			    (unsigned long long)pos);
 		if (m->size) {
 			if (diag)
 				printf("type GRAIN, %lu bytes of data, "
 				    "lba %llu\n", (unsigned long)m->size,
 				    (unsigned long long)m->val);
-			lseek(ofd, m->val * SECTORSZ, SEEK_SET);
-			marker2grain(ifd, h, m, grain, &dbuf, &dbufsz);
-			if (diag > 1)
-				printf("Seek output to %llu\n",
-				    (unsigned long long)m->val * SECTORSZ);
-			awrite(ofd, grain, h->grainSize * SECTORSZ, "grain");
+			/* With -U, inflate into a write buffer to queue */
+			if (wqp)
+				zw.grain = wqget(wqp, &slot);
+			marker2grain(ifd, h, m, &zw, -1, mapped);
+			/* -a appends newer grains that replace earlier ones */
+			g = m->val / h->grainSize;
+			again = g < grains && seen[g / 8] & (1 << g % 8);
+			grainout(ofd, zw.grain, h->grainSize * SECTORSZ,
+			    m->val * SECTORSZ, wqp, slot, again);
+			if (g < grains)
+				seen[g / 8] |= 1 << g % 8;
+			__atomic_store_n(&stats.done, g + 1, __ATOMIC_RELAXED);
+			if (mapped) {
+				pos += (12 + m->size + SECTORSZ - 1) /
+				    SECTORSZ * SECTORSZ;
+				continue;
+			}
 		} else switch (m->u.type) {
 		case MARKER_GT:
 			assert(m->val == mtblblks);
@@ -472,9 +1354,14 @@ vmdkparsestream(int ifd, struct SparseExtentHeader *h, int ofd)
 				assert(m->val == mdirblks);
 			if (diag)
 				vmdkshowtable(ifd, pos / SECTORSZ + 1,
-				    m->u.type, h);
+				    m->u.type, h, NULL);
 			else
 				lseek(ifd, m->val * SECTORSZ, SEEK_CUR);
+			if (m->u.type == MARKER_GD && ofd != -1) {
+				zw.grain = grain;
+				streamshared(ifd, h, pos / SECTORSZ + 1,
+				    m->val, seen, ofd, &zw);
+			}
 			break;
 
 		case MARKER_FOOTER:
@@ -503,175 +1390,1418 @@ vmdkparsestream(int ifd, struct SparseExtentHeader *h, int ofd)
 		}
 		pos = lseek(ifd, 0, SEEK_CUR);
 	}
-	free(dbuf);
-	free(grain);
+	if (wqp)
+		wqend(wqp);
+	if (!sparseout && ofd >= 0) {
+		memset(grain, '\0', h->grainSize * SECTORSZ);
+		for (g = 0; g < grains; g++)
+			if (!(seen[g / 8] & (1 << g % 8)))
+				zeroout(ofd, h, g, grain);
+	}
+	free(seen);
+	zw.grain = grain;
+	zend(&zw);
 }
 
 /*
- * Read either a grain table or a grain directory entry, returning the 32bit
- * value.  The passed 'sec' is the starting sector of the table or directory
- * block.
+ * Random access extraction.  Each thread repeatedly claims the next grain
+ * table's worth of grains and extracts them using pread() and pwrite(), so
+ * no file offsets are shared.  If the grains aren't stored in LBA order,
+ * the allocated ones are first sorted by where they are in the input and
+ * claimed in that order instead, so that the input is read in one forward
+ * sweep.
  */
-static uint32_t
-readentry(int ifd, SectorType sec, SectorType entry)
+struct extraction {
+	pthread_mutex_t	lock;
+	const struct SparseExtentHeader *h;
+	const struct vmdkmap *map;
+	int		ifd;
+	int		ofd;
+	const SectorType *order;	/* Grains to extract, NULL => all */
+	SectorType	grains;		/* Entries in order[] or the map */
+	SectorType	next;		/* The first one not yet claimed */
+};
+
+static const uint32_t *sortgt;		/* The map being sorted */
+
+static int
+physcmp(const void *a, const void *b)
 {
-	char buf[SECTORSZ];
-	int itemsperblock;
-	uint32_t val;
+	SectorType ga = *(const SectorType *)a, gb = *(const SectorType *)b;
+
+	if (sortgt[ga] != sortgt[gb])
+		return sortgt[ga] < sortgt[gb] ? -1 : 1;
+	return ga < gb ? -1 : ga > gb;
+}
+
+/*
+ * Return the allocated grains sorted by their position in the input, or
+ * NULL if that's LBA order anyway.  Unallocated and zero grains need no
+ * reading and are accounted for here.
+ */
+static SectorType *
+physorder(const struct vmdkmap *map, SectorType *count)
+{
+	SectorType *order, n, seeks;
+	uint32_t last;
+	uint64_t start;
+
+	for (last = 0, n = seeks = 0; n < map->grains; n++)
+		if (map->gt[n] > 1) {
+			if (map->gt[n] < last)
+				seeks++;
+			last = map->gt[n];
+		}
+	if (!seeks)
+		return NULL;
+
+	start = monotime();
+	assert(order = malloc(map->grains * sizeof *order));
+	for (*count = n = 0; n < map->grains; n++)
+		if (map->gt[n] > 1)
+			order[(*count)++] = n;
+		else if (map->gt[n] == 1)
+			statadd(&stats.zero, 1);
+	sortgt = map->gt;
+	qsort(order, *count, sizeof *order, physcmp);
+	sortgt = NULL;
+	start = monotime() - start;
+	statadd(&stats.ns[ST_SORT], start);
+	statadd(&stats.avoided, seeks);
+	statadd(&stats.done, map->grains - *count);
+	if (diag)
+		printf("Sorted %llu grains by input offset in %.3fs, avoiding "
+		    "%llu backward seeks\n", (unsigned long long)*count,
+		    start / 1e9, (unsigned long long)seeks);
+
+	return order;
+}
+
+static void *
+grains2raw(void *arg)
+{
+	struct extraction *x = arg;
+	SectorType end, first, g, n;
+	struct zworker zw;
+	struct wq wq, *wqp;
+
+	zinit(&zw, -1, x->h->grainSize * SECTORSZ, 0);
+	wqp = useuring && wqinit(&wq, x->ofd, URING_WBUFS,
+	    x->h->grainSize * SECTORSZ) ? &wq : NULL;
+	for (;;) {
+		pthread_mutex_lock(&x->lock);
+		n = x->next;
+		x->next += x->h->numGTEsPerGT;
+		pthread_mutex_unlock(&x->lock);
+		if (n >= x->grains)
+			break;
+
+		end = n + x->h->numGTEsPerGT;
+		if (end > x->grains)
+			end = x->grains;
+		for (first = n; n < end; n++) {
+			g = x->order ? x->order[n] : n;
+			grain2raw(x->ifd, x->h, x->map->gt[g], x->ofd, g, &zw,
+			    wqp);
+		}
+		statadd(&stats.done, end - first);
+	}
+	if (wqp)
+		wqend(wqp);
+	zend(&zw);
 
-	itemsperblock = SECTORSZ / sizeof(uint32_t);
+	return NULL;
+}
 
-	lseek(ifd, (sec + entry / itemsperblock) * SECTORSZ, SEEK_SET);
-	aread(ifd, buf, SECTORSZ);
+static void
+allgrains2raw(int ifd, const struct SparseExtentHeader *h,
+    const struct vmdkmap *map, int ofd, int threads)
+{
+	struct extraction x;
+	SectorType *order, n;
+	unsigned char *zeros;
+	pthread_t *tid;
+	int t;
+
+	if (!sparseout) {
+		assert(zeros = alignalloc(h->grainSize * SECTORSZ));
+		memset(zeros, '\0', h->grainSize * SECTORSZ);
+		for (n = 0; n < map->grains; n++)
+			if (map->gt[n] <= 1)
+				zeroout(ofd, h, n, zeros);
+		free(zeros);
+	}
+
+	memset(&x, '\0', sizeof x);
+	pthread_mutex_init(&x.lock, NULL);
+	x.h = h;
+	x.map = map;
+	x.ifd = ifd;
+	x.ofd = ofd;
+	x.grains = map->grains;
+	x.order = order = physorder(map, &x.grains);
 
-	memcpy(&val, buf + 4 * (entry % 128), 4);
-	return val;
+	if (threads > 1) {
+		if (diag)
+			printf("Extracting with %d threads\n", threads);
+		assert(tid = calloc(threads, sizeof *tid));
+		for (t = 0; t < threads; t++)
+			assert(pthread_create(tid + t, NULL, grains2raw, &x) == 0);
+		for (t = 0; t < threads; t++)
+			pthread_join(tid[t], NULL);
+		free(tid);
+	} else
+		grains2raw(&x);
+
+	free(order);
+	pthread_mutex_destroy(&x.lock);
 }
 
 static void
-grain2raw(int ifd, const struct SparseExtentHeader *h, int ofd, SectorType n,
-    unsigned char **buf, size_t *bufsz)
+setsize(int fd, SectorType capacity)
 {
-	SectorType blk, tbl;
+	struct stat st;
+
+	assert(fstat(fd, &st) == 0);
+	if (!S_ISREG(st.st_mode) || (SectorType)st.st_size == capacity * SECTORSZ)
+		return;
+	if (ftruncate(fd, capacity * SECTORSZ) == -1) {
+		/* Not every filesystem can grow a file this way */
+		lseek(fd, capacity * SECTORSZ, SEEK_SET);
+		awrite(fd, "", 1, "NUL byte");
+		assert(ftruncate(fd, capacity * SECTORSZ) == 0);
+	}
+}
+
+/*
+ * For -P, allocate space for each run of grains that -r will write, so that
+ * the data ends up contiguous on disk while the rest stays sparse.
+ */
+static void
+preallocate(int fd, const struct SparseExtentHeader *h,
+    const struct vmdkmap *map)
+{
+	SectorType end, n, start;
+	int err;
+
+	if (!sparseout)
+		return;		/* Only files have space to allocate */
+	for (n = 0; n < map->grains; n = end) {
+		for (start = n; start < map->grains && map->gt[start] <= 1;)
+			start++;
+		for (end = start; end < map->grains && map->gt[end] > 1;)
+			end++;
+		if (start == end)
+			break;
+#ifdef __APPLE__
+		err = EOPNOTSUPP;
+#else
+		err = posix_fallocate(fd, start * h->grainSize * SECTORSZ,
+		    (end - start) * h->grainSize * SECTORSZ);
+#endif
+		if (err) {
+			fprintf(stderr, "Warning: posix_fallocate: %s\n",
+			    strerror(err));
+			return;
+		}
+		if (diag > 1)
+			printf("Allocated grains %llu - %llu\n",
+			    (unsigned long long)start,
+			    (unsigned long long)end - 1);
+	}
+}
+
+/*
+ * -C checks every grain that the grain tables reference and computes the
+ * SHA-256 digest of the disk's contents, unallocated grains reading as
+ * zeros, without writing anything.  Worker threads claim grains in LBA
+ * order and check and inflate them into a ring of 'nslots' scratch
+ * buffers, which the main thread hashes in order as they fill.
+ */
+#define VSLOT_EMPTY	0
+#define VSLOT_DATA	1
+#define VSLOT_ZERO	2		/* Unallocated, zero or bad */
+
+struct verify {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	const struct SparseExtentHeader *h;
+	const struct vmdkmap *map;
+	int		ifd;
+	off_t		size;		/* Of the VMDK */
+	unsigned	nslots;
+	unsigned char	**buf;
+	int		*state;		/* VSLOT_* */
+	SectorType	next;		/* The first grain not yet claimed */
+	SectorType	hashed;		/* Grains hashed so far */
+	uint64_t	bad;
+};
+
+static int
+verifybad(SectorType g, const char *why)
+{
+	fprintf(stderr, "Grain %llu: %s\n", (unsigned long long)g, why);
+	return -1;
+}
+
+/*
+ * Check grain 'g' and inflate it into 'out'.  Returns VSLOT_DATA or
+ * VSLOT_ZERO, or -1 after reporting the problem.
+ */
+static int
+verifygrain(const struct verify *vf, SectorType g, struct zworker *zw,
+    unsigned char *out)
+{
+	const struct SparseExtentHeader *h = vf->h;
+	SectorType lba, owner;
+	uint64_t start;
 	struct Marker m;
-	unsigned char *grain;
+	z_stream *strm;
+	size_t gsz;
+	uint32_t gte;
+	off_t pos;
 
-	if ((tbl = readentry(ifd, h->gdOffset, n / h->numGTEsPerGT)) == 0)
+	if ((gte = vf->map->gt[g]) <= 1) {
+		if (gte == 1)
+			statadd(&stats.zero, 1);
+		return VSLOT_ZERO;
+	}
+	gsz = h->grainSize * SECTORSZ;
+	pos = (off_t)gte * SECTORSZ;
+	if (gte < h->overHead || pos + 12 > vf->size)
+		return verifybad(g, "GTE is outside the grain area");
+
+	if (!(h->flags & FLAGBIT_COMPRESSED)) {
+		if (pos + (off_t)gsz > vf->size)
+			return verifybad(g, "Runs past the end of the file");
+		apread(vf->ifd, out, gsz, pos);
+		statgrain(gsz);
+		return VSLOT_DATA;
+	}
+
+	apread(vf->ifd, &m, 12, pos);
+	lba = m.val;
+	owner = lba / h->grainSize;
+	if (!m.size || lba % h->grainSize || owner >= vf->map->grains)
+		return verifybad(g, "Bad grain marker LBA");
+	/*
+	 * With -D, the marker holds the LBA of the grain's first use, which
+	 * -a may since have zeroed or replaced, so what that grain's GTE
+	 * says now proves nothing.  An earlier LBA has to stand on its own:
+	 * aligned, sized to fit and inflating to one grain.
+	 */
+	if (owner > g)
+		return verifybad(g, "Grain marker is for a later LBA");
+	if (m.size > compressBound(gsz) || pos + 12 + m.size > vf->size)
+		return verifybad(g, "Bad grain marker size");
+	statgrain(12 + m.size);
+
+	if (zw->bufsz < m.size) {
+		zw->bufsz = m.size;
+		assert(zw->buf = countrealloc(zw->buf, zw->bufsz));
+	}
+	apread(vf->ifd, zw->buf, m.size, pos + 12);
+	strm = &zw->strm;
+	assert(inflateReset(strm) == Z_OK);
+	strm->avail_in = m.size;
+	strm->next_in = zw->buf;
+	strm->avail_out = gsz;
+	strm->next_out = out;
+	start = stattime();
+	if (inflate(strm, Z_FINISH) != Z_STREAM_END || strm->avail_in ||
+	    strm->avail_out)
+		return verifybad(g, "Grain doesn't inflate to a whole grain");
+	stattimer(ST_INFLATE, start);
+
+	return VSLOT_DATA;
+}
+
+static void *
+verifygrains(void *arg)
+{
+	struct verify *vf = arg;
+	struct zworker zw;
+	unsigned slot;
+	SectorType g;
+	int res;
+
+	zinit(&zw, -1, 0, 0);
+	pthread_mutex_lock(&vf->lock);
+	for (;;) {
+		while (vf->next < vf->map->grains &&
+		    vf->next >= vf->hashed + vf->nslots)
+			pthread_cond_wait(&vf->cond, &vf->lock);
+		if (vf->next >= vf->map->grains)
+			break;
+		g = vf->next++;
+		pthread_mutex_unlock(&vf->lock);
+
+		slot = g % vf->nslots;
+		res = verifygrain(vf, g, &zw, vf->buf[slot]);
+		statadd(&stats.done, 1);
+
+		pthread_mutex_lock(&vf->lock);
+		if (res == -1) {
+			vf->bad++;
+			res = VSLOT_ZERO;
+		}
+		vf->state[slot] = res;
+		pthread_cond_broadcast(&vf->cond);
+	}
+	pthread_mutex_unlock(&vf->lock);
+	zend(&zw);
+
+	return NULL;
+}
+
+/*
+ * Returns the number of bad grains, leaving the digest of the disk in
+ * 'digest'.
+ */
+static uint64_t
+verifyall(int ifd, off_t size, const struct SparseExtentHeader *h,
+    const struct vmdkmap *map, int threads, unsigned inflight,
+    unsigned char digest[SHA256_LEN])
+{
+	unsigned char *zeros;
+	struct sha256 ctx;
+	struct verify vf;
+	uint64_t left;
+	pthread_t *tid;
+	unsigned slot;
+	SectorType g;
+	size_t gsz;
+	int state, t;
+
+	gsz = h->grainSize * SECTORSZ;
+	memset(&vf, '\0', sizeof vf);
+	pthread_mutex_init(&vf.lock, NULL);
+	pthread_cond_init(&vf.cond, NULL);
+	vf.h = h;
+	vf.map = map;
+	vf.ifd = ifd;
+	vf.size = size;
+	vf.nslots = inflight;
+	assert(vf.buf = calloc(vf.nslots, sizeof *vf.buf));
+	assert(vf.state = calloc(vf.nslots, sizeof *vf.state));
+	for (slot = 0; slot < vf.nslots; slot++)
+		assert(vf.buf[slot] = countalloc(gsz));
+	assert(zeros = calloc(1, gsz));
+
+	if (diag)
+		printf("Verifying with %d threads and %u grain buffers\n",
+		    threads, vf.nslots);
+	assert(tid = calloc(threads, sizeof *tid));
+	for (t = 0; t < threads; t++)
+		assert(pthread_create(tid + t, NULL, verifygrains, &vf) == 0);
+
+	sha256init(&ctx);
+	left = h->capacity * SECTORSZ;
+	for (g = 0; g < map->grains; g++) {
+		slot = g % vf.nslots;
+		pthread_mutex_lock(&vf.lock);
+		while ((state = vf.state[slot]) == VSLOT_EMPTY)
+			pthread_cond_wait(&vf.cond, &vf.lock);
+		pthread_mutex_unlock(&vf.lock);
+
+		sha256update(&ctx, state == VSLOT_DATA ? vf.buf[slot] : zeros,
+		    left < gsz ? left : gsz);
+		left -= left < gsz ? left : gsz;
+
+		pthread_mutex_lock(&vf.lock);
+		vf.state[slot] = VSLOT_EMPTY;
+		vf.hashed = g + 1;
+		pthread_cond_broadcast(&vf.cond);
+		pthread_mutex_unlock(&vf.lock);
+	}
+	sha256final(&ctx, digest);
+
+	for (t = 0; t < threads; t++)
+		pthread_join(tid[t], NULL);
+	free(tid);
+	free(zeros);
+	for (slot = 0; slot < vf.nslots; slot++)
+		free(vf.buf[slot]);
+	free(vf.state);
+	free(vf.buf);
+	pthread_cond_destroy(&vf.cond);
+	pthread_mutex_destroy(&vf.lock);
+
+	return vf.bad;
+}
+
+/*
+ * The largest grain marker that raw2mem() can produce, rounded up to a
+ * whole number of sectors.
+ */
+static size_t
+markerbound(void)
+{
+	size_t sz;
+
+	sz = 12 + compressBound(grainsecs * SECTORSZ);
+	if (sz % SECTORSZ)
+		sz = (sz / SECTORSZ + 1) * SECTORSZ;
+	return sz;
+}
+
+/*
+ * The deflate level for -v.  It starts out as the -z strength and is
+ * adjusted by ratecheck() when -T is used.
+ */
+static int zlevel;
+static unsigned long nstored;	/* Grains stored by -A */
+
+#define ENTROPY_STORE	7.9	/* Bits per byte above which -A stores */
+#define ENTROPY_SAMPLE	1024	/* Bytes sampled from each 4k ... */
+#define ENTROPY_MINSAMPLE 16384	/* ... but at least this many per grain */
+#define RATEGRAINS	64	/* Grains between -T adjustments */
+
+/*
+ * Estimate the order-0 entropy of a grain in bits per byte from a sample
+ * of its data.  Encrypted or already compressed data comes out close to 8.
+ * Small samples underestimate it, so small grains are sampled more densely.
+ */
+static double
+grainentropy(const unsigned char *grain, size_t n)
+{
+	unsigned count[256], i, sample;
+	double e, p, total;
+	size_t off;
+
+	sample = ENTROPY_SAMPLE;
+	if (n / 4096 * sample < ENTROPY_MINSAMPLE)
+		sample = n >= ENTROPY_MINSAMPLE ? ENTROPY_MINSAMPLE / (n / 4096) :
+		    4096;
+	memset(count, '\0', sizeof count);
+	for (off = 0; off + 4096 <= n; off += 4096)
+		for (i = 0; i < sample; i++)
+			count[grain[off + i]]++;
+	total = (double)(n / 4096) * sample;
+	for (e = 0, i = 0; i < 256; i++)
+		if (count[i]) {
+			p = count[i] / total;
+			e -= p * log2(p);
+		}
+	return e;
+}
+
+/*
+ * With -D, identical grains are written once.  The SHA-256 of each grain,
+ * truncated to DEDUP_KEYLEN bytes, is kept in an open addressed hash table
+ * with the sector that the grain was written to, and later copies are
+ * given that sector as their GTE rather than being written again.
+ */
+#define DEDUP_KEYLEN	16
+#define DEDUP_INITIAL	1024		/* Starting hash table size */
+
+struct dedupent {
+	unsigned char	key[DEDUP_KEYLEN];
+	uint32_t	sec;		/* The grain's marker, 0 if free */
+	uint32_t	len;		/* Bytes written for it */
+};
+
+struct dedup {
+	struct dedupent	*ent;
+	size_t		size;		/* A power of 2 */
+	size_t		used;
+};
+
+static void
+grainkey(const unsigned char *grain, unsigned char *key)
+{
+	unsigned char digest[SHA256_LEN];
+	struct sha256 ctx;
+
+	sha256init(&ctx);
+	sha256update(&ctx, grain, grainsecs * SECTORSZ);
+	sha256final(&ctx, digest);
+	memcpy(key, digest, DEDUP_KEYLEN);
+}
+
+static void
+dedupinit(struct dedup *d)
+{
+	d->size = DEDUP_INITIAL;
+	d->used = 0;
+	assert(d->ent = calloc(d->size, sizeof *d->ent));
+}
+
+static struct dedupent *
+dedupslot(struct dedupent *ent, size_t size, const unsigned char *key)
+{
+	uint64_t hash;
+	size_t n;
+
+	memcpy(&hash, key, sizeof hash);
+	for (n = hash & (size - 1); ent[n].sec; n = (n + 1) & (size - 1))
+		if (memcmp(ent[n].key, key, DEDUP_KEYLEN) == 0)
+			break;
+	return ent + n;
+}
+
+/*
+ * Return the sector of an earlier grain with the given key, or 0.
+ */
+static uint32_t
+dedupfind(struct dedup *d, const unsigned char *key)
+{
+	struct dedupent *e;
+
+	if ((e = dedupslot(d->ent, d->size, key))->sec == 0)
+		return 0;
+	statadd(&stats.deduped, 1);
+	statadd(&stats.dedupbytes, e->len);
+	return e->sec;
+}
+
+static void
+dedupadd(struct dedup *d, const unsigned char *key, uint32_t sec, size_t len)
+{
+	struct dedupent *e, *ent;
+	size_t n;
+
+	if ((d->used + 1) * 2 > d->size) {
+		assert(ent = calloc(d->size * 2, sizeof *ent));
+		for (n = 0; n < d->size; n++)
+			if (d->ent[n].sec)
+				*dedupslot(ent, d->size * 2, d->ent[n].key) =
+				    d->ent[n];
+		free(d->ent);
+		d->ent = ent;
+		d->size *= 2;
+	}
+	e = dedupslot(d->ent, d->size, key);
+	memcpy(e->key, key, DEDUP_KEYLEN);
+	e->sec = sec;
+	e->len = len;
+	d->used++;
+}
+
+static void
+dedupend(struct dedup *d)
+{
+	if (diag)
+		printf("Deduplicated %llu grains, saving %llu bytes; %lu "
+		    "unique grains indexed in %lu bytes\n",
+		    (unsigned long long)stats.deduped,
+		    (unsigned long long)stats.dedupbytes,
+		    (unsigned long)d->used,
+		    (unsigned long)(d->size * sizeof *d->ent));
+	free(d->ent);
+}
+
+/*
+ * With -I, grains that are unchanged from the reference VMDK have their
+ * compressed data copied from it rather than being deflated again.  The
+ * reference grain is inflated through libvmdk and compared with ours.
+ * Returns the size of the data copied to 'out', or 0.
+ */
+static struct vmdk *ref;
+
+static size_t
+refcopy(struct zworker *zw, const unsigned char *grain, SectorType sec,
+    unsigned char *out, size_t outsz)
+{
+	uint64_t start;
+	ssize_t got;
+	size_t sz;
+
+	sz = grainsecs * SECTORSZ;
+	if (zw->ref == NULL)
+		assert(zw->ref = alignalloc(sz));
+	start = stattime();
+	got = vmdkpread(ref, zw->ref, sz, sec * SECTORSZ);
+	stattimer(ST_INFLATE, start);
+	if (got != (ssize_t)sz || memcmp(zw->ref, grain, sz))
+		return 0;
+	if ((got = vmdkgrain(ref, sec / grainsecs, out, outsz)) <= 0)
+		return 0;
+	statadd(&stats.reused, 1);
+	return got;
+}
+
+/*
+ * Deflate a grain into 'out', returning the compressed size.  If
+ * 'adaptive', grains that look incompressible are written as stored
+ * deflate blocks.
+ */
+static uint32_t
+rawdeflate(struct zworker *zw, unsigned char *grain, unsigned char *out,
+    size_t outsz, int adaptive)
+{
+	uint64_t start;
+	z_stream *strm;
+	int level;
+
+	level = __atomic_load_n(&zlevel, __ATOMIC_RELAXED);
+	if (adaptive && level &&
+	    grainentropy(grain, grainsecs * SECTORSZ) > ENTROPY_STORE) {
+		level = 0;
+		__atomic_add_fetch(&nstored, 1, __ATOMIC_RELAXED);
+	}
+
+	strm = &zw->strm;
+	assert(deflateReset(strm) == Z_OK);
+	strm->avail_out = outsz;
+	strm->next_out = out;
+	if (level != zw->level) {
+		/* Before zlib 1.2.12 this may write the header to next_out */
+		strm->avail_in = 0;
+		assert(deflateParams(strm, level, Z_DEFAULT_STRATEGY) == Z_OK);
+		zw->level = level;
+	}
+	strm->avail_in = grainsecs * SECTORSZ;
+	strm->next_in = grain;
+	start = stattime();
+	assert(deflate(strm, Z_FINISH) == Z_STREAM_END);
+	stattimer(ST_DEFLATE, start);
+	if (diag > 1)
+		printf("DEFLATEd grain from %lu to %lu\n",
+		    (unsigned long)(grainsecs * SECTORSZ),
+		    (unsigned long)strm->total_out);
+
+	return strm->total_out;
+}
+
+/*
+ * Fill in the marker in front of 'size' bytes of compressed data at 'out'
+ * for the grain at 'sec', pad to a sector and return the total length.
+ */
+static size_t
+grainmarker(unsigned char *out, SectorType sec, uint32_t size)
+{
+	size_t len;
+
+	memcpy(out, &sec, sizeof sec);
+	memcpy(out + sizeof sec, &size, sizeof size);
+	len = 12 + size;
+	if (len % SECTORSZ) {
+		memset(out + len, '\0', SECTORSZ - len % SECTORSZ);
+		len = (len / SECTORSZ + 1) * SECTORSZ;
+	}
+	statgrain(len);
+
+	return len;
+}
+
+/*
+ * Compress a grain into 'out' as a complete grain marker, zero padded to a
+ * sector boundary.  Returns the number of bytes to write or 0 if the grain
+ * holds no data.
+ */
+static size_t
+raw2mem(struct zworker *zw, unsigned char *grain, SectorType sec,
+    unsigned char *out, size_t outsz, int adaptive)
+{
+	uint32_t size;
+
+	if (grainempty(grain, grainsecs * SECTORSZ))
+		return 0;	/* No data */
+
+	if (ref == NULL ||
+	    (size = refcopy(zw, grain, sec, out + 12, outsz - 12)) == 0)
+		size = rawdeflate(zw, grain, out + 12, outsz - 12, adaptive);
+
+	return grainmarker(out, sec, size);
+}
+
+/*
+ * Output for -v is gathered into a large buffer and written with a single
+ * pwrite() when it fills, so that grains are compressed straight into the
+ * buffer and cost far less than one system call each.  With -U, a full
+ * buffer is queued on an io_uring and filling carries on in the next one.
+ */
+#define OBUFSZ		(1024 * 1024)
+
+struct obuf {
+	int		fd;
+	unsigned char	*buf;
+	size_t		len;		/* Bytes waiting in 'buf' */
+	size_t		size;
+	off_t		pos;		/* Output offset of buf[0] */
+	int		stream;		/* Output can't seek; write() in order */
+	struct wq	wq;
+	struct wq	*wqp;		/* NULL unless queueing writes */
+	unsigned	slot;		/* The wq buffer that 'buf' is */
+};
+
+static void
+obufinit(struct obuf *ob, int fd, off_t pos, int stream)
+{
+	ob->fd = fd;
+	ob->stream = stream;
+	ob->len = 0;
+	ob->size = OBUFSZ;
+	while (ob->size < 2 * markerbound())	/* Big grains with -g */
+		ob->size *= 2;
+	ob->pos = pos;
+	ob->wqp = NULL;
+	if (useuring && !stream && wqinit(&ob->wq, fd, URING_OBUFS, ob->size)) {
+		ob->wqp = &ob->wq;
+		ob->buf = wqget(ob->wqp, &ob->slot);
 		return;
-	if ((blk = readentry(ifd, tbl, n % h->numGTEsPerGT)) <= 1)
+	}
+	assert(ob->buf = alignalloc(ob->size));
+}
+
+/*
+ * Write 'n' bytes at the current output position.  A pipe may accept
+ * less than we ask for, so streamed output is written in a loop.
+ */
+static void
+obufout(struct obuf *ob, const void *data, size_t n, const char *what)
+{
+	uint64_t start;
+	const char *p;
+	ssize_t got;
+	size_t left;
+
+	if (!ob->stream) {
+		apwrite(ob->fd, data, n, ob->pos, what);
+		ob->pos += n;
 		return;
+	}
 
-	blk *= SECTORSZ;
-	lseek(ifd, blk, SEEK_SET);
+	for (p = data, left = n; left; p += got, left -= got) {
+		start = stattime();
+		got = write(ob->fd, p, left);
+		stattimer(ST_WRITE, start);
+		statadd(&stats.writes, 1);
+		if (got == -1) {
+			if (errno == EINTR) {
+				got = 0;
+				continue;
+			}
+			perror("write");
+			abort();
+		}
+	}
+	statadd(&stats.bytesout, n);
 	if (diag > 1)
-		printf("Pos 0x%llx (%llu): ", (unsigned long long)blk,
-		    (unsigned long long)blk);
-	aread(ifd, &m, sizeof m);
-	assert(m.size);
-	assert(m.val == n * h->grainSize);
-	if (diag)
-		printf("type GRAIN, %lu bytes of data, lba %llu\n",
-		    (unsigned long)m.size, (unsigned long long)m.val);
+		printf("Wrote %s of %lu bytes at offset 0x%llx\n",
+		    what, (unsigned long)n, (unsigned long long)ob->pos);
+	ob->pos += n;
+}
+
+/*
+ * Write out the buffer.  Unless 'all' is set, output opened for direct I/O
+ * only has the part that ends on a DIRECT_ALIGN boundary written, and the
+ * rest is kept at the start of the buffer.
+ */
+static void
+obufflush(struct obuf *ob, int all)
+{
+	unsigned char *was;
+	off_t end;
+	size_t n;
+
+	n = ob->len;
+	if (!all && cachedirect(ob->fd)) {
+		end = (ob->pos + ob->len) & ~(off_t)(DIRECT_ALIGN - 1);
+		if (end > ob->pos)
+			n = end - ob->pos;
+	}
+	if (!n)
+		return;
 
-	assert(grain = malloc(h->grainSize * SECTORSZ));
-	marker2grain(ifd, h, &m, grain, buf, bufsz);
+	if (ob->wqp) {
+		wqput(ob->wqp, ob->slot, n, ob->pos, "output buffer");
+		was = ob->buf;
+		ob->buf = wqget(ob->wqp, &ob->slot);
+		memcpy(ob->buf, was + n, ob->len - n);
+		ob->pos += n;
+	} else {
+		obufout(ob, ob->buf, n, "output buffer");
+		memmove(ob->buf, ob->buf + n, ob->len - n);
+	}
+	ob->len -= n;
+}
+
+/*
+ * Return a pointer to 'n' contiguous free bytes at the end of the buffer.
+ */
+static unsigned char *
+obufspace(struct obuf *ob, size_t n)
+{
+	assert(n <= ob->size);
+	if (ob->size - ob->len < n)
+		obufflush(ob, 0);
+	return ob->buf + ob->len;
+}
 
+/*
+ * Commit 'n' bytes previously filled in via obufspace(), returning their
+ * output offset.
+ */
+static off_t
+obufput(struct obuf *ob, size_t n, const char *what)
+{
+	off_t pos;
+
+	pos = ob->pos + ob->len;
+	ob->len += n;
 	if (diag > 1)
-		printf("Seek output to offset %llu\n",
-		    (unsigned long long)n * h->grainSize * SECTORSZ);
-	lseek(ofd, n * h->grainSize * SECTORSZ, SEEK_SET);
-	awrite(ofd, grain, h->grainSize * SECTORSZ, "grain");
-	free(grain);
+		printf("Queued %s of %lu bytes at offset 0x%llx\n",
+		    what, (unsigned long)n, (unsigned long long)pos);
+	return pos;
+}
+
+static off_t
+obufwrite(struct obuf *ob, const void *data, size_t n, const char *what)
+{
+	off_t pos;
+
+	if (n > ob->size) {
+		obufflush(ob, 1);
+		pos = ob->pos;
+		obufout(ob, data, n, what);
+		return pos;
+	}
+	memcpy(obufspace(ob, n), data, n);
+	return obufput(ob, n, what);
 }
 
 static void
-allgrains2raw(int ifd, const struct SparseExtentHeader *h, int ofd)
-{
-	SectorType grains, n;
-	size_t dbufsz;
-	unsigned char *dbuf;
-
-	dbuf = NULL;
-	dbufsz = 0;
-	grains = h->capacity / h->grainSize;
-	if (h->capacity % h->grainSize)
-		grains++;
-	for (n = 0; n < grains; n++)
-		grain2raw(ifd, h, ofd, n, &dbuf, &dbufsz);
-	free(dbuf);
+obufend(struct obuf *ob)
+{
+	if (ob->wqp) {
+		wqput(ob->wqp, ob->slot, ob->len, ob->pos, "output buffer");
+		ob->pos += ob->len;
+		ob->len = 0;
+		wqend(ob->wqp);
+		return;
+	}
+	obufflush(ob, 1);
+	free(ob->buf);
+}
+
+/*
+ * Reads the raw input for -v a grain at a time.  Where the input supports
+ * SEEK_DATA, grains that lie entirely within a hole are reported as such
+ * without being read.  With -U, the grains of a regular file are read
+ * ahead on an io_uring, in a ring of slots in input order.
+ */
+struct rawreader {
+	int		fd;
+	off_t		pos;		/* Offset of the next grain */
+	off_t		size;		/* Input size, or -1 if not a file */
+	off_t		data;		/* Start of the next data region */
+	off_t		hole;		/* End of that data region */
+	int		seekdata;	/* Look for holes */
+	uint64_t	capacity;
+	uint64_t	read_total;
+	struct ioq	*ioq;		/* NULL unless reading ahead */
+	unsigned char	*rabuf[URING_RAGRAINS];
+	off_t		rapos[URING_RAGRAINS];
+	ssize_t		rares[URING_RAGRAINS];
+	int		radone[URING_RAGRAINS];
+	unsigned	rahead;		/* Slot of the earliest read */
+	unsigned	racount;	/* Reads queued or done, from rahead */
+	off_t		ranext;		/* Where the next read-ahead starts */
+};
+
+static void
+rawinit(struct rawreader *r, int fd, uint64_t capacity)
+{
+	struct stat st;
+	unsigned n;
+
+	memset(r, '\0', sizeof *r);
+	r->fd = fd;
+	r->capacity = capacity;
+	r->size = -1;
+	lseek(fd, 0, SEEK_SET);		/* -d has read the boot sector */
+	assert(fstat(fd, &st) == 0);
+	if (S_ISREG(st.st_mode)) {
+		r->size = st.st_size;
+#ifdef SEEK_DATA
+		r->seekdata = 1;
+#endif
+		if (useuring) {
+			if ((r->ioq = ioqopen(URING_RAGRAINS)) == NULL) {
+				if (diag)
+					printf("io_uring: %s, using "
+					    "synchronous I/O\n",
+					    strerror(errno));
+				return;
+			}
+			for (n = 0; n < URING_RAGRAINS; n++)
+				assert(r->rabuf[n] =
+				    alignalloc(grainsecs * SECTORSZ));
+		}
+	}
+}
+
+/* Wait until the read in the given slot has completed */
+static void
+rawreap(struct rawreader *r, unsigned slot)
+{
+	uint64_t tag;
+	ssize_t res;
+
+	while (!r->radone[slot]) {
+		assert(ioqwait(r->ioq, &tag, &res) == 0);
+		if (res < 0) {
+			errno = -res;
+			perror("pread");
+			abort();
+		}
+		statadd(&stats.bytesin, res);
+		cachedone(r->fd, res);
+		r->rares[tag] = res;
+		r->radone[tag] = 1;
+	}
+}
+
+/*
+ * Queue reads of the grains following r->pos, stopping at the end of the
+ * current data region so that holes are still never read.
+ */
+static void
+rawahead(struct rawreader *r)
+{
+	off_t end;
+	unsigned slot;
+
+	/* Drop anything we've gone past */
+	while (r->racount && r->rapos[r->rahead] < r->pos) {
+		rawreap(r, r->rahead);
+		r->rahead = (r->rahead + 1) % URING_RAGRAINS;
+		r->racount--;
+	}
+
+	end = r->size;
+	if (r->capacity && (off_t)r->capacity < end)
+		end = r->capacity;
+	if (r->seekdata && r->hole < end)
+		end = r->hole;
+	if (r->ranext < r->pos)
+		r->ranext = r->pos;
+	if (r->seekdata && r->ranext < r->data)
+		r->ranext = r->data - r->data % (grainsecs * SECTORSZ);
+
+	while (r->racount < URING_RAGRAINS && r->ranext < end) {
+		slot = (r->rahead + r->racount++) % URING_RAGRAINS;
+		r->rapos[slot] = r->ranext;
+		r->radone[slot] = 0;
+		ioqread(r->ioq, iofd(r->fd, r->rabuf[slot],
+		    grainsecs * SECTORSZ, r->ranext), r->rabuf[slot],
+		    grainsecs * SECTORSZ, r->ranext, slot);
+		r->ranext += grainsecs * SECTORSZ;
+	}
+	ioqsubmit(r->ioq);
+}
+
+/*
+ * Read the grain at r->pos from the read-ahead ring, falling back to
+ * pread() if it wasn't queued.
+ */
+static size_t
+rawfetch(struct rawreader *r, unsigned char *grain)
+{
+	size_t got;
+
+	rawahead(r);
+	if (!r->racount || r->rapos[r->rahead] != r->pos)
+		return apread(r->fd, grain, grainsecs * SECTORSZ, r->pos);
+
+	rawreap(r, r->rahead);
+	got = r->rares[r->rahead];
+	memcpy(grain, r->rabuf[r->rahead], got);
+	if (got != grainsecs * SECTORSZ)
+		memset(grain + got, '\0', grainsecs * SECTORSZ - got);
+	r->rahead = (r->rahead + 1) % URING_RAGRAINS;
+	r->racount--;
+	return got;
+}
+
+static void
+rawend(struct rawreader *r)
+{
+	unsigned n;
+
+	if (r->ioq == NULL)
+		return;
+	for (; r->racount; r->racount--) {
+		rawreap(r, r->rahead);
+		r->rahead = (r->rahead + 1) % URING_RAGRAINS;
+	}
+	for (n = 0; n < URING_RAGRAINS; n++)
+		free(r->rabuf[n]);
+	ioqclose(r->ioq);
+	r->ioq = NULL;
 }
 
+/*
+ * Is the next grain entirely within a hole?
+ */
+static int
+rawhole(struct rawreader *r)
+{
+	if (!r->seekdata || r->pos >= r->size)
+		return 0;
+	if (r->capacity && r->read_total >= r->capacity)
+		return 0;
+
+#ifdef SEEK_DATA
+	if (r->pos >= r->hole) {
+		if ((r->data = lseek(r->fd, r->pos, SEEK_DATA)) == -1) {
+			if (errno != ENXIO) {
+				/* Not supported here, read everything */
+				if (diag)
+					printf("SEEK_DATA: %s, not looking "
+					    "for holes\n", strerror(errno));
+				r->seekdata = 0;
+				return 0;
+			}
+			r->data = r->size;	/* All hole to EOF */
+			r->hole = r->size + 1;
+		} else {
+			if ((r->hole = lseek(r->fd, r->data, SEEK_HOLE)) == -1)
+				r->hole = r->size;
+			if (diag > 1)
+				printf("Data at 0x%llx - 0x%llx\n",
+				    (unsigned long long)r->data,
+				    (unsigned long long)r->hole);
+		}
+	}
+#endif
+
+	return r->pos + (off_t)(grainsecs * SECTORSZ) <= r->data ||
+	    r->data == r->size;
+}
+
+/*
+ * Read the next grain, returning the number of input bytes it covers or 0
+ * at the end of the input.  If the grain is a hole, *hole is set and
+ * 'grain' is left untouched.
+ */
+static size_t
+rawread(struct rawreader *r, unsigned char *grain, int *hole)
+{
+	size_t got;
+
+	if (r->capacity && r->read_total >= r->capacity) {
+		if (diag > 1)
+			printf("Capacity capped at %llu\n",
+			    (unsigned long long)r->capacity);
+		return 0;
+	}
+
+	if ((*hole = rawhole(r)) != 0) {
+		got = grainsecs * SECTORSZ;
+		if (r->pos + (off_t)got > r->size)
+			got = r->size - r->pos;
+	} else if (r->size == -1 && !cachedirect(r->fd))
+		got = aread(r->fd, grain, grainsecs * SECTORSZ);
+	else if (r->size == -1)		/* Devices are seekable */
+		got = apread(r->fd, grain, grainsecs * SECTORSZ, r->pos);
+	else if (r->ioq != NULL)
+		got = rawfetch(r, grain);
+	else
+		got = apread(r->fd, grain, grainsecs * SECTORSZ, r->pos);
+
+	r->pos += got;
+	r->read_total += got;
+
+	return got;
+}
+
+/*
+ * With -j, grains are read by one thread, deflated by a pool of workers and
+ * written in LBA order by the caller of allraw2grains().  Jobs are taken
+ * from a ring of 'njobs' slots in sequence, so no more than 'njobs' grains
+ * are ever held in memory.  A run of hole grains is passed through as a
+ * single job.
+ */
+struct grainjob {
+	unsigned char	*grain;		/* Raw grain data */
+	unsigned char	*out;		/* The compressed grain marker */
+	size_t		outlen;		/* Bytes of 'out' to write, 0 if empty */
+	uint64_t	got;		/* Input bytes covered by this job */
+	unsigned	holes;		/* A run of this many hole grains */
+	SectorType	sec;
+	unsigned char	key[DEDUP_KEYLEN];	/* For -D */
+	int		done;
+};
+
+struct pipeline {
+	pthread_mutex_t	lock;
+	pthread_cond_t	room;		/* The writer freed a job */
+	pthread_cond_t	work;		/* The reader filled a job */
+	pthread_cond_t	done;		/* A worker finished a job */
+	struct grainjob	*job;
+	unsigned	njobs;
+	uint64_t	nread;		/* Jobs filled by the reader */
+	uint64_t	nclaimed;	/* Jobs taken by a worker */
+	uint64_t	nwritten;	/* Jobs released by the writer */
+	int		eof;
+	pthread_t	*tid;
+	int		nthreads;
+	struct rawreader *r;
+	const struct writeopts *o;
+	size_t		outsz;
+};
+
+static void *
+pipereader(void *arg)
+{
+	struct pipeline *p = arg;
+	struct grainjob *j;
+	SectorType sec;
+	size_t got;
+	int hole;
+
+	for (sec = 0; ; sec += grainsecs) {
+		pthread_mutex_lock(&p->lock);
+		while (p->nread - p->nwritten == p->njobs)
+			pthread_cond_wait(&p->room, &p->lock);
+		j = p->job + p->nread % p->njobs;
+		pthread_mutex_unlock(&p->lock);
+
+		j->sec = sec;
+		j->got = got = rawread(p->r, j->grain, &hole);
+		j->holes = hole ? 1 : 0;
+		j->outlen = 0;
+		if (hole)
+			while (j->holes < UINT_MAX && rawhole(p->r)) {
+				j->got += rawread(p->r, j->grain, &hole);
+				j->holes++;
+				sec += grainsecs;
+			}
+
+		pthread_mutex_lock(&p->lock);
+		if (!got) {
+			p->eof = 1;
+			pthread_cond_broadcast(&p->work);
+			pthread_cond_signal(&p->done);
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		j->done = j->holes ? 1 : 0;
+		p->nread++;
+		pthread_cond_signal(&p->work);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+static void *
+pipeworker(void *arg)
+{
+	struct pipeline *p = arg;
+	struct grainjob *j;
+	struct zworker zw;
+
+	zinit(&zw, p->o->zstrength, 0, 0);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->nclaimed < p->nread &&
+		    p->job[p->nclaimed % p->njobs].holes)
+			p->nclaimed++;
+		if (p->nclaimed == p->nread) {
+			if (p->eof)
+				break;
+			pthread_cond_wait(&p->work, &p->lock);
+			continue;
+		}
+		j = p->job + p->nclaimed++ % p->njobs;
+		pthread_mutex_unlock(&p->lock);
+
+		j->outlen = raw2mem(&zw, j->grain, j->sec, j->out, p->outsz,
+		    p->o->adaptive);
+		if (j->outlen && p->o->dedup)
+			grainkey(j->grain, j->key);
+
+		pthread_mutex_lock(&p->lock);
+		j->done = 1;
+		pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	zend(&zw);
+
+	return NULL;
+}
+
+static void
+pipestart(struct pipeline *p, struct rawreader *r, const struct writeopts *o)
+{
+	unsigned n;
+	int t;
+
+	memset(p, '\0', sizeof *p);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->room, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->r = r;
+	p->o = o;
+	p->outsz = markerbound();
+	p->njobs = o->inflight;
+	assert(p->job = calloc(p->njobs, sizeof *p->job));
+	for (n = 0; n < p->njobs; n++) {
+		assert(p->job[n].grain = alignalloc(grainsecs * SECTORSZ));
+		assert(p->job[n].out = countalloc(p->outsz));
+	}
+
+	p->nthreads = o->threads + 1;
+	assert(p->tid = calloc(p->nthreads, sizeof *p->tid));
+	assert(pthread_create(p->tid, NULL, pipereader, p) == 0);
+	for (t = 1; t < p->nthreads; t++)
+		assert(pthread_create(p->tid + t, NULL, pipeworker, p) == 0);
+	if (diag)
+		printf("Deflating with %d threads, %u grains in flight\n",
+		    o->threads, o->inflight);
+}
+
+/*
+ * Return the next grain in LBA order once it has been compressed, or NULL
+ * when the input is exhausted.  The job must be handed back with pipedone().
+ */
+static struct grainjob *
+pipenext(struct pipeline *p)
+{
+	struct grainjob *j;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		if (p->nwritten < p->nread) {
+			j = p->job + p->nwritten % p->njobs;
+			if (j->done)
+				break;
+		} else if (p->eof) {
+			j = NULL;
+			break;
+		}
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return j;
+}
+
+static void
+pipedone(struct pipeline *p, struct grainjob *j)
+{
+	pthread_mutex_lock(&p->lock);
+	j->done = 0;
+	p->nwritten++;
+	pthread_cond_signal(&p->room);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void
+pipeend(struct pipeline *p)
+{
+	unsigned n;
+	int t;
+
+	for (t = 0; t < p->nthreads; t++)
+		pthread_join(p->tid[t], NULL);
+	for (n = 0; n < p->njobs; n++) {
+		free(p->job[n].grain);
+		free(p->job[n].out);
+	}
+	free(p->job);
+	free(p->tid);
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->room);
+	pthread_mutex_destroy(&p->lock);
+}
+
+/*
+ * Called every RATEGRAINS deflated grains with -T to move the deflate level
+ * towards one that converts at 'rate' MB/s.  Holes and zero grains aren't
+ * counted, as they'd make sparse input look faster than it deflates.
+ */
 static void
-setsize(int fd, SectorType capacity)
+ratecheck(struct timespec *last, unsigned rate, int maxlevel)
 {
-	struct stat st;
-
-	assert(fstat(fd, &st) == 0);
-	if ((SectorType)st.st_size != capacity * SECTORSZ) {
-		lseek(fd, capacity * SECTORSZ, SEEK_SET);
-		awrite(fd, "", 1, "NUL byte");
-		assert(ftruncate(fd, capacity * SECTORSZ) == 0);
+	struct timespec now;
+	double mbs, secs;
+	int level;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - last->tv_sec + (now.tv_nsec - last->tv_nsec) / 1e9;
+	*last = now;
+	mbs = RATEGRAINS * grainsecs * SECTORSZ / (1024.0 * 1024) / secs;
+
+	level = zlevel;
+	if (mbs < rate && level > 1)
+		level--;
+	else if (mbs > rate * 1.25 && level < maxlevel)
+		level++;
+	if (level != zlevel) {
+		if (diag)
+			printf("%.1f MB/s, deflate level now %d\n", mbs, level);
+		__atomic_store_n(&zlevel, level, __ATOMIC_RELAXED);
 	}
 }
 
-static uint32_t
-raw2grain(unsigned char *grain, int ofd, SectorType sec, int zstrength)
+static void
+mkdesc(char *descblk, size_t sz, uint64_t capacity, const char *type,
+    const char *extent)
 {
-	off_t start, end;
-	struct Marker m;
-	z_stream strm;
-	int i, ret;
-
-	for (i = SET_GRAINSZ * SECTORSZ; i; i--)
-		if (grain[i - 1])
-			break;
-	if (!i)
-		return 0;	/* No data */
-
-	start = lseek(ofd, 0, SEEK_CUR);
-
-	m.val = sec;
-	m.size = -1;
-	memset(&strm, '\0', sizeof strm);
-	assert(deflateInit(&strm, zstrength) == Z_OK);
-	strm.avail_in = SET_GRAINSZ * SECTORSZ;
-	strm.next_in = grain;
-	strm.avail_out = SECTORSZ - 12;
-	strm.next_out = (unsigned char *)&m + 12;
-	ret = Z_OK;
-	while (ret == Z_OK) {
-		ret = deflate(&strm, Z_FINISH);
-		assert(ret == Z_OK || ret == Z_STREAM_END);
-		awrite(ofd, &m, sizeof m - strm.avail_out, "compressed grain");
-		strm.avail_out = SECTORSZ;
-		strm.next_out = (unsigned char *)&m;
-	}
-	deflateEnd(&strm);
-
-	end = lseek(ofd, 0, SEEK_CUR);
-	if (diag > 1)
-		printf("DEFLATEd grain from %lu to %lu\n",
-		    SET_GRAINSZ * SECTORSZ, (unsigned long)(end - start));
-
-	/* Go back and write the size */
-	assert(end - start > 12);
-	m.val = sec;
-	m.size = end - start - 12;
-	lseek(ofd, start, SEEK_SET);
-	if (diag > 1)
-		printf("Rewound to the start of the grain... ");
-	awrite(ofd, &m, 12, "grain size");
-	if (end % SECTORSZ)
-		end = (end / SECTORSZ + 1) * SECTORSZ;
-	lseek(ofd, end, SEEK_SET);
-	if (diag > 1)
-		printf("Moved to the end of the grain... ");
-
-	return (uint32_t)(start / SECTORSZ);
+	memset(descblk, '\0', sz);
+	snprintf(descblk, sz,
+	    "# Disk DescriptorFile\n"
+	    "version=1\n"
+	    "CID=278f54ff\n"
+	    "parentCID=ffffffff\n"
+	    "createType=\"%s\"\n"
+	    "\n"
+	    "\n"
+	    "# Extent description\n"
+	    "%s %lu SPARSE \"%s\"\n"
+	    "\n"
+	    "#DDB\n"
+	    "ddb.virtualHWVersion = \"4\"\n"
+	    "ddb.geometry.cylinders = \"%lu\"\n"
+	    "ddb.geometry.heads = \"255\"\n"
+	    "ddb.geometry.sectors = \"63\"\n"
+	    "ddb.adapterType = \"lsilogic\"\n"
+	    "ddb.toolsVersion = \"6532\"\n",
+	    type, strcmp(type, "streamOptimized") ? "RW" : "RDONLY",
+	    (unsigned long)(capacity / SECTORSZ), extent,
+	    (unsigned long)(capacity / 63 / 255));
 }
 
 static void
-allraw2grains(int ifd, uint64_t capacity, int ofd, int zstrength)
+allraw2grains(int ifd, int ofd, const struct writeopts *o)
 {
-        unsigned char grain[SET_GRAINSZ * SECTORSZ];
+	unsigned char *grain, *out, key[DEDUP_KEYLEN];
 	struct Marker eos, footer, *mdir, *mtbl;
 	struct SparseExtentHeader h;
-	int mdirent, mtblent, n;
+	size_t len, mdirsz, mtblsz, outsz;
+	uint32_t ent, mtblent, mtblused;
 	char descblk[SECTORSZ];
-	size_t mdirsz, mtblsz;
-	uint64_t read_total;
+	int mdirent, n;
+	uint64_t capacity;
+	struct rawreader r;
+	struct zworker zw;
+	struct pipeline p;
+	struct dedup dd;
+	struct obuf ob;
+	struct timespec last;
+	struct grainjob *j;
+	unsigned deflated, holes;
 	SectorType sec;
-	uint32_t ent;
-	ssize_t got;
+	size_t got;
+	int hole, zdone;
 
 	memset(&h, '\0', sizeof h);
 	h.magicNumber = VMDK_MAGIC;
 	h.version = SET_VMDKVER;
 	h.flags = FLAGBIT_NL | FLAGBIT_COMPRESSED | FLAGBIT_MARKERS;
-	h.grainSize = SET_GRAINSZ;
+	if (o->zggte)
+		h.flags |= FLAGBIT_ZGGTE;
+	h.grainSize = grainsecs;
 	h.descriptorOffset = sizeof h / SECTORSZ;
 	h.descriptorSize = sizeof descblk / SECTORSZ;
-	h.numGTEsPerGT = SET_GTESPERGT;
+	h.numGTEsPerGT = gtespergt;
 	h.rgdOffset = 0;
 	h.gdOffset = -1;		/* Don't know yet */
 	h.overHead = MIN_HEADER_OVERHEAD;
@@ -684,38 +2814,125 @@ allraw2grains(int ifd, uint64_t capacity, int ofd, int zstrength)
 	h.doubleEndLineChar2 = '\n';
 	h.compressAlgorithm = COMPRESSION_DEFLATE;
 
-	lseek(ofd, h.overHead * SECTORSZ, SEEK_SET);
+	if (o->stream) {
+		/*
+		 * Everything is written in order, so the header goes out
+		 * first with gdOffset still -1.  Readers find the grain
+		 * directory through the copy of the header in the footer.
+		 */
+		assert(o->capacity);
+		h.capacity = o->capacity / SECTORSZ;
+		obufinit(&ob, ofd, 0, 1);
+		obufwrite(&ob, &h, sizeof h, "header");
+		mkdesc(descblk, sizeof descblk, o->capacity,
+		    "streamOptimized", "generated-stream.vmdk");
+		obufwrite(&ob, descblk, sizeof descblk, "descriptor block");
+		len = h.overHead * SECTORSZ - sizeof h - sizeof descblk;
+		memset(obufspace(&ob, len), '\0', len);
+		obufput(&ob, len, "header padding");
+	} else
+		obufinit(&ob, ofd, h.overHead * SECTORSZ, 0);
 
 	mdirsz = SECTORSZ * 2;
 	assert(mdir = calloc(1, mdirsz));
-	mtblsz = SET_GTESPERGT * sizeof(uint32_t);
+	mtblsz = gtespergt * sizeof(uint32_t);
 	assert(mtbl = calloc(1, SECTORSZ + mtblsz));
+	outsz = markerbound();
+
+	if (o->capacity)
+		stats.grains = (o->capacity / SECTORSZ + grainsecs - 1) /
+		    grainsecs;
+	zlevel = o->zstrength;
+	if (o->rate)
+		clock_gettime(CLOCK_MONOTONIC, &last);
+
+	assert(grain = alignalloc(grainsecs * SECTORSZ));
+	if (o->dedup)
+		dedupinit(&dd);
+	rawinit(&r, ifd, o->capacity);
+	if (!stats.grains && r.size > 0)
+		stats.grains = (r.size / SECTORSZ + grainsecs - 1) /
+		    grainsecs;
+	if (o->threads > 1)
+		pipestart(&p, &r, o);
+	else
+		zinit(&zw, o->zstrength, 0, 0);
 
 	got = -1;
-	mdirent = mtblent = 0;
-	lseek(ifd, 0, SEEK_SET);
-	read_total = 0;
-	for (sec = 0; got; sec += SET_GRAINSZ) {
-		if (capacity && read_total >= capacity) {
-			if (diag > 1)
-				printf("Capacity capped at %llu\n",
-				    (unsigned long long)capacity);
-			got = 0;
-		} else
-			got = aread(ifd, grain, sizeof grain);
+	j = NULL;
+	holes = deflated = 0;
+	mdirent = mtblent = mtblused = 0;
+	for (sec = 0; got; sec += grainsecs) {
+		ent = 0;
+		zdone = 0;
+		if (o->threads > 1) {
+			if (j == NULL && (j = pipenext(&p)) != NULL)
+				holes = j->holes;
+			if (j == NULL)
+				got = 0;
+			else if (holes) {
+				/* The next grain of a run of holes */
+				got = j->got - (uint64_t)(j->holes - holes) *
+				    grainsecs * SECTORSZ;
+				if (got > grainsecs * SECTORSZ)
+					got = grainsecs * SECTORSZ;
+				hole = 1;
+				holes--;
+			} else {
+				got = j->got;
+				hole = 0;
+				zdone = j->outlen != 0;
+				if (j->outlen && o->dedup)
+					ent = dedupfind(&dd, j->key);
+				if (j->outlen && !ent) {
+					ent = obufwrite(&ob, j->out, j->outlen,
+					    "compressed grain") / SECTORSZ;
+					if (o->dedup)
+						dedupadd(&dd, j->key, ent,
+						    j->outlen);
+				}
+			}
+			if (j != NULL && !holes) {
+				pipedone(&p, j);
+				j = NULL;
+			}
+		} else if ((got = rawread(&r, grain, &hole)) != 0 && !hole) {
+			if (o->dedup &&
+			    !grainempty(grain, grainsecs * SECTORSZ)) {
+				grainkey(grain, key);
+				if ((ent = dedupfind(&dd, key)) != 0)
+					statadd(&stats.allocated, 1);
+			}
+			if (!ent) {
+				out = obufspace(&ob, outsz);
+				len = raw2mem(&zw, grain, sec, out, outsz,
+				    o->adaptive);
+				zdone = len != 0;
+			} else
+				len = 0;
+			if (len) {
+				ent = obufput(&ob, len, "compressed grain") /
+				    SECTORSZ;
+				if (o->dedup)
+					dedupadd(&dd, key, ent, len);
+			}
+		}
 		if (got) {
-			read_total += got;
-			ent = raw2grain(grain, ofd, sec, zstrength);
+			if (!ent && !hole) {
+				statadd(&stats.zero, 1);
+				if (o->zggte)
+					ent = 1;	/* A zero grain */
+			}
+			if (ent)
+				mtblused++;
 			memcpy((char *)mtbl + SECTORSZ + mtblent * 4, &ent, 4);
 			mtblent++;
+			statadd(&stats.done, 1);
+			if (o->rate && zdone && ++deflated % RATEGRAINS == 0)
+				ratecheck(&last, o->rate, o->zstrength);
 		}
 
-		if (mtblent == SET_GTESPERGT || (mtblent && !got)) {
-			mtbl->val = mtblsz / SECTORSZ;
-			mtbl->size = 0;
-			mtbl->u.type = MARKER_GT;
-			ent = lseek(ofd, 0, SEEK_CUR) / SECTORSZ + 1;
-			awrite(ofd, mtbl, SECTORSZ + mtblsz, "grain table");
+		if (mtblent == gtespergt || (mtblent && !got)) {
 			n = SECTORSZ / sizeof(uint32_t) + mdirent++;
 			if (n * sizeof(uint32_t) >= mdirsz) {
 				assert(mdir = realloc(mdir, mdirsz + SECTORSZ));
@@ -723,128 +2940,751 @@ allraw2grains(int ifd, uint64_t capacity, int ofd, int zstrength)
 				mdirsz += SECTORSZ;
 				assert(n * sizeof(uint32_t) < mdirsz);
 			}
-			memcpy((char *)mdir + n * 4, &ent, 4);
+			if (mtblused) {
+				mtbl->val = mtblsz / SECTORSZ;
+				mtbl->size = 0;
+				mtbl->u.type = MARKER_GT;
+				ent = obufwrite(&ob, mtbl, SECTORSZ + mtblsz,
+				    "grain table") / SECTORSZ + 1;
+				memcpy((char *)mdir + n * 4, &ent, 4);
+			}
+			/* Otherwise the grain table is left unallocated */
 			memset(mtbl, '\0', SECTORSZ + mtblsz);
-			mtblent = 0;
+			mtblent = mtblused = 0;
 		}
 	}
 
 	mdir->val = mdirsz / SECTORSZ - 1;
 	mdir->size = 0;
 	mdir->u.type = MARKER_GD;
-	ent = lseek(ofd, 0, SEEK_CUR) / SECTORSZ + 1;
-	awrite(ofd, mdir, mdirsz, "grain dir");
-	h.gdOffset = ent;
+	h.gdOffset = obufwrite(&ob, mdir, mdirsz, "grain dir") / SECTORSZ + 1;
 
 	memset(&footer, '\0', sizeof footer);
 	footer.val = sizeof h / SECTORSZ;
 	footer.size = 0;
 	footer.u.type = MARKER_FOOTER;
-	awrite(ofd, &footer, sizeof footer, "footer");
+	obufwrite(&ob, &footer, sizeof footer, "footer");
 
 	/* Finish assigning our header before writing it to disk */
-	if (!capacity) {
-		capacity = read_total;
+	if (!(capacity = o->capacity)) {
+		capacity = r.read_total;
 		if (diag > 1)
 			printf("Capacity calculated as %llu\n",
 			    (unsigned long long)capacity);
 	}
 	h.capacity = capacity / SECTORSZ;
-	awrite(ofd, &h, sizeof h, "header");
+	stats.grains = (h.capacity + h.grainSize - 1) / h.grainSize;
+	obufwrite(&ob, &h, sizeof h, "header");
 
 	memset(&eos, '\0', sizeof eos);
 	eos.val = 0;
 	eos.size = 0;
 	eos.u.type = MARKER_EOS;
-	awrite(ofd, &eos, sizeof eos, "eos");
+	obufwrite(&ob, &eos, sizeof eos, "eos");
+	obufend(&ob);
 
 	free(mtbl);
 	free(mdir);
+	free(grain);
+	if (o->threads > 1)
+		pipeend(&p);
+	else
+		zend(&zw);
+	rawend(&r);
+	if (o->dedup)
+		dedupend(&dd);
+	if (diag && o->adaptive)
+		printf("Stored %lu incompressible grains\n", nstored);
+
+	if (!o->stream) {
+		/* Now write the header & descriptor block at the beginning */
+		apwrite(ofd, &h, sizeof h, 0, "header");
+		mkdesc(descblk, sizeof descblk, capacity, "streamOptimized",
+		    "generated-stream.vmdk");
+		apwrite(ofd, &descblk, sizeof descblk,
+		    h.descriptorOffset * SECTORSZ, "descriptor block");
+	}
+}
 
-	/* Go back and write the header & descriptor block at the beginning */
-	lseek(ofd, 0, SEEK_SET);
-	if (diag > 1)
-		printf("Rewound to the start of the file... ");
-	awrite(ofd, &h, sizeof h, "header");
+/*
+ * Write a hosted monolithicSparse extent for -m.  Grains are stored whole,
+ * so a hypervisor can run from the file directly.  The overhead holds the
+ * header, a descriptor, the redundant grain directory and its tables, and
+ * the grain directory and its tables, all preallocated for the capacity
+ * and rounded up to a grain.  Grains follow in input order through an
+ * obuf, and the overhead is written last once every GTE is known.
+ */
+static void
+allraw2sparse(int ifd, int ofd, const struct writeopts *o)
+{
+	SectorType gdents, gdsecs, grains, gtsecs, n;
+	struct SparseExtentHeader h;
+	unsigned char *grain, *meta;
+	uint32_t *gd, *gt, *rgd;
+	struct rawreader r;
+	struct obuf ob;
+	size_t got, sz;
+	int hole;
+
+	assert(o->capacity);
+	memset(&h, '\0', sizeof h);
+	h.magicNumber = VMDK_MAGIC;
+	h.version = 1;
+	h.flags = FLAGBIT_NL | FLAGBIT_RGT;
+	if (o->zggte)
+		h.flags |= FLAGBIT_ZGGTE;
+	h.capacity = o->capacity / SECTORSZ;
+	h.grainSize = grainsecs;
+	h.descriptorOffset = sizeof h / SECTORSZ;
+	h.descriptorSize = SPARSE_DESCSECS;
+	h.numGTEsPerGT = gtespergt;
+	h.uncleanShutdown = 0;
+	h.singleEndLineChar = '\n';
+	h.nonEndLineChar = ' ';
+	h.doubleEndLineChar1 = '\r';
+	h.doubleEndLineChar2 = '\n';
+	h.compressAlgorithm = COMPRESSION_NONE;
+
+	grains = (h.capacity + h.grainSize - 1) / h.grainSize;
+	gdents = (grains + h.numGTEsPerGT - 1) / h.numGTEsPerGT;
+	gdsecs = (gdents * sizeof *gd + SECTORSZ - 1) / SECTORSZ;
+	gtsecs = h.numGTEsPerGT * sizeof *gt / SECTORSZ;
+	h.rgdOffset = h.descriptorOffset + h.descriptorSize;
+	h.gdOffset = h.rgdOffset + gdsecs + gdents * gtsecs;
+	h.overHead = h.gdOffset + gdsecs + gdents * gtsecs;
+	h.overHead = (h.overHead + h.grainSize - 1) / h.grainSize *
+	    h.grainSize;
+	stats.grains = grains;
+
+	assert(meta = alignalloc(h.overHead * SECTORSZ));
+	memset(meta, '\0', h.overHead * SECTORSZ);
+	rgd = (uint32_t *)(void *)(meta + h.rgdOffset * SECTORSZ);
+	gd = (uint32_t *)(void *)(meta + h.gdOffset * SECTORSZ);
+	gt = gd + gdsecs * SECTORSZ / sizeof *gd;
+
+	sz = h.grainSize * SECTORSZ;
+	obufinit(&ob, ofd, h.overHead * SECTORSZ, 0);
+	rawinit(&r, ifd, o->capacity);
+	for (n = 0; n < grains; n++) {
+		/* Read straight into the output buffer, keeping it if used */
+		grain = obufspace(&ob, sz);
+		if ((got = rawread(&r, grain, &hole)) == 0)
+			break;
+		statadd(&stats.done, 1);
+		if (hole)
+			continue;
+		if (got < sz)
+			memset(grain + got, '\0', sz - got);
+		if (grainempty(grain, sz)) {
+			statadd(&stats.zero, 1);
+			if (o->zggte)
+				gt[n] = 1;	/* A zero grain */
+			continue;
+		}
+		gt[n] = obufput(&ob, sz, "grain") / SECTORSZ;
+		statgrain(sz);
+	}
+	obufend(&ob);
+	rawend(&r);
 
-	memset(descblk, '\0', sizeof descblk);
-	snprintf(descblk, sizeof descblk,
-	    "# Disk DescriptorFile\n"
-	    "version=1\n"
-	    "CID=278f54ff\n"
-	    "parentCID=ffffffff\n"
-	    "createType=\"streamOptimized\"\n"
-	    "\n"
-	    "\n"
-	    "# Extent description\n"
-	    "RDONLY %lu SPARSE \"generated-stream.vmdk\"\n"
-	    "\n"
-	    "#DDB\n"
-	    "ddb.virtualHWVersion = \"4\"\n"
-	    "ddb.geometry.cylinders = \"%lu\"\n"
-	    "ddb.geometry.heads = \"255\"\n"
-	    "ddb.geometry.sectors = \"63\"\n"
-	    "ddb.adapterType = \"lsilogic\"\n"
-	    "ddb.toolsVersion = \"6532\"\n",
-	    (unsigned long)(capacity / SECTORSZ),
-	    (unsigned long)(capacity / 63 / 255));
-	awrite(ofd, &descblk, sizeof descblk, "descriptor block");
+	/* Both directories point at tables that are always allocated */
+	for (n = 0; n < gdents; n++) {
+		rgd[n] = h.rgdOffset + gdsecs + n * gtsecs;
+		gd[n] = h.gdOffset + gdsecs + n * gtsecs;
+	}
+	memcpy(rgd + gdsecs * SECTORSZ / sizeof *rgd, gt,
+	    gdents * gtsecs * SECTORSZ);
+
+	memcpy(meta, &h, sizeof h);
+	mkdesc((char *)meta + h.descriptorOffset * SECTORSZ, SECTORSZ,
+	    o->capacity, "monolithicSparse", o->extent);
+	apwrite(ofd, meta, h.overHead * SECTORSZ, 0, "overhead");
+	free(meta);
+}
+
+/*
+ * Patch a streamOptimized VMDK in place for -a.  Each grain that the patch
+ * from 'pfd' touches, starting at byte 'offset' of the disk, is read back
+ * through libvmdk, overlaid with the patch data and deflated again.  The
+ * new grains are appended over the old footer, followed by fresh copies of
+ * just the grain tables that changed, a new grain directory, a footer and
+ * the EOS marker.  The grains and tables they replace are left where they
+ * are, unreferenced.  A grain that the patch turns to zeros gets a zero
+ * GTE, but if it held data a marker for it is still appended so that -s
+ * overwrites what it extracted earlier in the stream.  Returns 0, or -1
+ * after reporting an error.
+ */
+static int
+vmdkpatch(const char *fn, int pfd, uint64_t offset, int zstrength)
+{
+	struct Marker eos, footer, *mdir, *mtbl;
+	unsigned char *dirty, *grain, *out, *patch, *tail;
+	size_t got, gsz, gtsz, len, n, o, outsz;
+	struct SparseExtentHeader f, h;
+	struct vmdkmap map;
+	struct zworker zw;
+	struct stat st;
+	struct obuf ob;
+	struct vmdk *v;
+	SectorType g, sec;
+	uint32_t ent;
+	int fd, ret;
+	off_t end, size;
+
+	if ((fd = open(fn, O_RDWR)) == -1 || fstat(fd, &st) == -1) {
+		perror(fn);
+		return -1;
+	}
+	/* The file must end with a footer marker, the footer and EOS */
+	size = st.st_size;
+	if (size % SECTORSZ || vmdkfooter(fd, size, &f) == -1 ||
+	    apread(fd, &eos, sizeof eos, size - SECTORSZ) != sizeof eos ||
+	    eos.val || eos.size || eos.u.type != MARKER_EOS ||
+	    apread(fd, &h, sizeof h, 0) != sizeof h ||
+	    (f.flags & (FLAGBIT_COMPRESSED | FLAGBIT_MARKERS)) !=
+	    (FLAGBIT_COMPRESSED | FLAGBIT_MARKERS)) {
+		fprintf(stderr, "%s: Not a streamOptimized VMDK ending in "
+		    "a footer\n", fn);
+		close(fd);
+		return -1;
+	}
+	if (f.compressAlgorithm != COMPRESSION_DEFLATE ||
+	    f.grainSize < MIN_GRAINSZ || f.grainSize > MAX_GRAINSZ) {
+		fprintf(stderr, "%s: Grains must be deflated and %lu to %lu "
+		    "sectors\n", fn, MIN_GRAINSZ, MAX_GRAINSZ);
+		close(fd);
+		return -1;
+	}
+	grainsecs = f.grainSize;
+	/* Only a patch we can't see the end of is checked as it's read */
+	if (fstat(pfd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    offset + st.st_size > f.capacity * SECTORSZ) {
+		fprintf(stderr, "%s: The patch extends beyond the end of the "
+		    "disk\n", fn);
+		close(fd);
+		return -1;
+	}
+	if ((v = vmdkopen(fn, 0)) == NULL || vmdkloadmap(fd, &f, &map) == -1) {
+		fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+		if (v)
+			vmdkclose(v);
+		close(fd);
+		return -1;
+	}
+
+	gsz = grainsecs * SECTORSZ;
+	outsz = markerbound();
+	zlevel = zstrength;
+	zinit(&zw, zstrength, 0, 0);
+	assert(grain = alignalloc(gsz));
+	assert(patch = alignalloc(gsz));
+	assert(dirty = calloc(map.gdents, 1));
+	/*
+	 * Everything is appended after the old EOS, which is left in place
+	 * so that the file stays valid until the new footer is written.
+	 */
+	obufinit(&ob, fd, size, 0);
+
+	ret = 0;
+	for (;;) {
+		g = offset / gsz;
+		o = offset % gsz;
+		for (got = 0; got < gsz - o; got += n)
+			if ((n = aread(pfd, patch + got, gsz - o - got)) == 0)
+				break;
+		if (!got)
+			break;
+		if (offset + got > f.capacity * SECTORSZ) {
+			fprintf(stderr, "%s: The patch extends beyond the end "
+			    "of the disk\n", fn);
+			ret = -1;
+			break;
+		}
+		memset(grain, '\0', gsz);
+		if (vmdkpread(v, grain, gsz, g * gsz) == -1) {
+			fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+			ret = -1;
+			break;
+		}
+		memcpy(grain + o, patch, got);
+
+		sec = g * grainsecs;
+		out = obufspace(&ob, outsz);
+		if (!grainempty(grain, gsz)) {
+			len = raw2mem(&zw, grain, sec, out, outsz, 0);
+			ent = obufput(&ob, len, "compressed grain") / SECTORSZ;
+		} else {
+			if (map.gt[g] > 1) {
+				len = grainmarker(out, sec, rawdeflate(&zw,
+				    grain, out + 12, outsz - 12, 0));
+				obufput(&ob, len, "zeroed grain");
+			}
+			statadd(&stats.zero, 1);
+			ent = f.flags & FLAGBIT_ZGGTE ? 1 : 0;
+		}
+		map.gt[g] = ent;
+		dirty[g / f.numGTEsPerGT] = 1;
+		statadd(&stats.done, 1);
+		offset += got;
+		if (got < gsz - o)
+			break;
+	}
+	stats.grains = stats.done;	/* Only those patched are reported */
+
+	/* The rest is written regardless, so that the file stays usable */
+	gtsz = f.numGTEsPerGT * sizeof(uint32_t);
+	assert(mtbl = calloc(1, SECTORSZ + gtsz));
+	mtbl->val = gtsz / SECTORSZ;
+	mtbl->size = 0;
+	mtbl->u.type = MARKER_GT;
+	for (n = 0; n < map.gdents; n++)
+		if (dirty[n]) {
+			memcpy(mtbl + 1, map.gt + n * f.numGTEsPerGT, gtsz);
+			map.gd[n] = obufwrite(&ob, mtbl, SECTORSZ + gtsz,
+			    "grain table") / SECTORSZ + 1;
+		}
+
+	assert(mdir = calloc(1 + map.gdsecs, SECTORSZ));
+	mdir->val = map.gdsecs;
+	mdir->size = 0;
+	mdir->u.type = MARKER_GD;
+	memcpy(mdir + 1, map.gd, map.gdents * sizeof *map.gd);
+	f.gdOffset = obufwrite(&ob, mdir, (1 + map.gdsecs) * SECTORSZ,
+	    "grain dir") / SECTORSZ + 1;
+	end = (f.gdOffset + map.gdsecs) * SECTORSZ;
+	obufend(&ob);
+
+	/* Only once the rest is on disk does the new footer end the file */
+	if (fdatasync(fd) == -1) {
+		perror(fn);
+		ret = -1;
+	}
+	memset(&footer, '\0', sizeof footer);
+	footer.val = sizeof f / SECTORSZ;
+	footer.size = 0;
+	footer.u.type = MARKER_FOOTER;
+	assert(tail = alignalloc(sizeof footer + sizeof f + sizeof eos));
+	memcpy(tail, &footer, sizeof footer);
+	memcpy(tail + sizeof footer, &f, sizeof f);
+	memcpy(tail + sizeof footer + sizeof f, &eos, sizeof eos);
+	apwrite(fd, tail, sizeof footer + sizeof f + sizeof eos, end, "footer");
+	free(tail);
+
+	/* A header that wasn't streamed points at the grain dir as well */
+	if (h.gdOffset + 1 != 0) {
+		h.gdOffset = f.gdOffset;
+		apwrite(fd, &h, sizeof h, 0, "header");
+	}
+
+	free(mdir);
+	free(mtbl);
+	free(dirty);
+	free(patch);
+	free(grain);
+	zend(&zw);
+	vmdkfreemap(&map);
+	vmdkclose(v);
+	if (close(fd) == -1) {
+		perror(fn);
+		return -1;
+	}
+
+	return ret;
+}
+
+static void
+statreport(uint64_t start)
+{
+	static const char *timer[ST_TIMERS] = {
+		"read", "deflate", "inflate", "write", "sort"
+	};
+	uint64_t elapsed, unalloc;
+	const char *sep;
+	double latency;
+	int i;
+
+	elapsed = stattime() - start;
+	latency = stats.nbd.requests ?
+	    (double)stats.nbd.ns / stats.nbd.requests : 0;
+	unalloc = stats.grains - stats.allocated - stats.zero;
+	if (stats.allocated + stats.zero > stats.grains)
+		unalloc = 0;
+
+	if (statfmt == STATS_JSON) {
+		printf("{\"elapsed\": %.6f, \"time\": {", elapsed / 1e9);
+		for (i = 0, sep = ""; i < ST_TIMERS; i++, sep = ", ")
+			printf("%s\"%s\": %.6f", sep, timer[i],
+			    stats.ns[i] / 1e9);
+		printf("}, \"grains\": {\"total\": %llu, \"allocated\": %llu, "
+		    "\"zero\": %llu, \"unallocated\": %llu}",
+		    (unsigned long long)stats.grains,
+		    (unsigned long long)stats.allocated,
+		    (unsigned long long)stats.zero, (unsigned long long)unalloc);
+		printf(", \"bytes\": {\"in\": %llu, \"out\": %llu}",
+		    (unsigned long long)stats.bytesin,
+		    (unsigned long long)stats.bytesout);
+		printf(", \"syscalls\": {\"read\": %llu, \"write\": %llu}",
+		    (unsigned long long)stats.reads,
+		    (unsigned long long)stats.writes);
+		printf(", \"seeks\": {\"avoided\": %llu}",
+		    (unsigned long long)stats.avoided);
+		printf(", \"dedup\": {\"grains\": %llu, \"bytes\": %llu}",
+		    (unsigned long long)stats.deduped,
+		    (unsigned long long)stats.dedupbytes);
+		printf(", \"reused\": %llu", (unsigned long long)stats.reused);
+		printf(", \"nbd\": {\"reads\": %llu, \"bytes\": %llu, "
+		    "\"latency\": %.6f}",
+		    (unsigned long long)stats.nbd.requests,
+		    (unsigned long long)stats.nbd.bytes, latency / 1e9);
+		printf(", \"sectors\": {");
+		for (i = 0, sep = ""; i < ST_BUCKETS; i++, sep = ", ")
+			if (i < ST_BUCKETS - 1)
+				printf("%s\"%d\": %llu", sep, 1 << i,
+				    (unsigned long long)stats.hist[i]);
+			else
+				printf("%s\"more\": %llu", sep,
+				    (unsigned long long)stats.hist[i]);
+		printf("}}\n");
+		return;
+	}
+
+	printf("Elapsed: %.3fs\n", elapsed / 1e9);
+	for (i = 0; i < ST_TIMERS; i++)
+		printf("Time in %s: %.3fs\n", timer[i], stats.ns[i] / 1e9);
+	printf("Grains: %llu total, %llu allocated, %llu zero, "
+	    "%llu unallocated\n", (unsigned long long)stats.grains,
+	    (unsigned long long)stats.allocated,
+	    (unsigned long long)stats.zero, (unsigned long long)unalloc);
+	printf("Bytes: %llu in, %llu out\n",
+	    (unsigned long long)stats.bytesin,
+	    (unsigned long long)stats.bytesout);
+	printf("System calls: %llu read, %llu write\n",
+	    (unsigned long long)stats.reads, (unsigned long long)stats.writes);
+	printf("Input seeks: %llu avoided\n",
+	    (unsigned long long)stats.avoided);
+	printf("Deduplicated: %llu grains, %llu bytes\n",
+	    (unsigned long long)stats.deduped,
+	    (unsigned long long)stats.dedupbytes);
+	printf("Reused: %llu grains\n", (unsigned long long)stats.reused);
+	printf("NBD reads: %llu, %llu bytes, %.3fms mean latency\n",
+	    (unsigned long long)stats.nbd.requests,
+	    (unsigned long long)stats.nbd.bytes, latency / 1e6);
+	printf("Grain sizes:\n");
+	for (i = 0; i < ST_BUCKETS; i++)
+		if (i < ST_BUCKETS - 1)
+			printf("    <= %3d sectors: %llu\n", 1 << i,
+			    (unsigned long long)stats.hist[i]);
+		else
+			printf("    >  %3d sectors: %llu\n", 1 << (i - 1),
+			    (unsigned long long)stats.hist[i]);
+}
+
+/*
+ * Progress reports go to stderr every -p seconds and whenever SIGUSR1 (or
+ * SIGINFO) arrives.  They're made by a separate thread that samples the
+ * statistics counters, so the conversion itself only bumps stats.done.
+ */
+#define PROGRESS_POLL_MS	250
+
+static volatile sig_atomic_t progresswanted;
+
+struct progress {
+	pthread_t	tid;
+	pthread_mutex_t	lock;
+	pthread_cond_t	stop;
+	int		stopping;
+	unsigned	interval;	/* Seconds, 0 => only when signalled */
+	int		tovmdk;		/* Converting raw data to a VMDK */
+	uint64_t	start;
+	uint64_t	last;		/* When we last reported */
+	uint64_t	lastdone;	/* stats.done at that time */
+};
+
+static void
+progresssig(int sig __attribute__((__unused__)))
+{
+	progresswanted = 1;
+}
+
+static void
+progressreport(struct progress *pg, uint64_t now)
+{
+	double avg, cur, grainmb, ratio;
+	uint64_t done, eta, in, out;
+
+	done = __atomic_load_n(&stats.done, __ATOMIC_RELAXED);
+	in = __atomic_load_n(&stats.bytesin, __ATOMIC_RELAXED);
+	out = __atomic_load_n(&stats.bytesout, __ATOMIC_RELAXED);
+	grainmb = grainsecs * SECTORSZ / (1024.0 * 1024);
+	avg = now > pg->start ? done * grainmb / ((now - pg->start) / 1e9) : 0;
+	cur = now > pg->last ?
+	    (done - pg->lastdone) * grainmb / ((now - pg->last) / 1e9) : 0;
+	if (pg->tovmdk)
+		ratio = out ? (double)in / out : 0;
+	else
+		ratio = in ? (double)out / in : 0;
+
+	fprintf(stderr, "%llu", (unsigned long long)done);
+	if (stats.grains)
+		fprintf(stderr, "/%llu grains (%.1f%%)",
+		    (unsigned long long)stats.grains,
+		    100.0 * done / stats.grains);
+	else
+		fprintf(stderr, " grains");
+	fprintf(stderr, ", %.1f MB/s, %.1f MB/s average, ratio %.2f",
+	    cur, avg, ratio);
+	if (stats.grains > done && done && avg > 0) {
+		eta = (stats.grains - done) * grainmb / avg;
+		fprintf(stderr, ", ETA %llu:%02u:%02u",
+		    (unsigned long long)eta / 3600, (unsigned)(eta / 60 % 60),
+		    (unsigned)(eta % 60));
+	}
+	fprintf(stderr, "\n");
+
+	pg->last = now;
+	pg->lastdone = done;
+}
+
+static void *
+progressthread(void *arg)
+{
+	struct progress *pg = arg;
+	struct timespec ts;
+	uint64_t now;
+
+	pthread_mutex_lock(&pg->lock);
+	while (!pg->stopping) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += PROGRESS_POLL_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pg->stop, &pg->lock, &ts);
+		if (pg->stopping)
+			break;
+		now = monotime();
+		if (progresswanted || (pg->interval &&
+		    now - pg->last >= pg->interval * 1000000000ULL)) {
+			progresswanted = 0;
+			progressreport(pg, now);
+		}
+	}
+	pthread_mutex_unlock(&pg->lock);
+
+	return NULL;
+}
+
+static void
+progressstart(struct progress *pg, unsigned interval, int tovmdk)
+{
+	struct sigaction sa;
+
+	memset(pg, '\0', sizeof *pg);
+	pg->interval = interval;
+	pg->tovmdk = tovmdk;
+	pg->start = pg->last = monotime();
+	pthread_mutex_init(&pg->lock, NULL);
+	pthread_cond_init(&pg->stop, NULL);
+
+	memset(&sa, '\0', sizeof sa);
+	sa.sa_handler = progresssig;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+#ifdef SIGINFO
+	sigaction(SIGINFO, &sa, NULL);
+#endif
+
+	assert(pthread_create(&pg->tid, NULL, progressthread, pg) == 0);
+}
+
+static void
+progressend(struct progress *pg)
+{
+	pthread_mutex_lock(&pg->lock);
+	pg->stopping = 1;
+	pthread_cond_signal(&pg->stop);
+	pthread_mutex_unlock(&pg->lock);
+	pthread_join(pg->tid, NULL);
+	pthread_cond_destroy(&pg->stop);
+	pthread_mutex_destroy(&pg->lock);
 }
 
 int
 main(int argc, char **argv)
 {
-	const char *randomfn, *streamfn, *vmdkfn;
+	const char *nbdfn, *patchfn, *randomfn, *reffn, *streamfn, *vmdkfn;
 	char block[SECTORSZ], *dbuf, *end;
-	int ch, ifd, outspec, ofd, opti, zstrength;
+	unsigned char digest[SHA256_LEN];
+	char hex[SHA256_LEN * 2 + 1];
+	int ch, ifd, optA, optC, optD, optM, optm, optP, outspec, ofd, opti;
+	int needmap, optZ;
+	int pfd, threads;
+	int zstrength;
 	struct SparseExtentHeader h;
-	int64_t capacity;
+	const char *p;
+	struct writeopts wo;
+	struct vmdkmap map;
+	struct vmdk *v;
+	int64_t capacity, grainsz, patchoff;
 	uint32_t optt;
+	uint64_t bad;
+	unsigned n;
+	unsigned cachegrains, inflight, interval, rate;
+	struct progress pg;
+	uint64_t started;
 	struct Marker *m;
 	SectorType sec;
-	struct stat st;
+	struct stat rst, st;
 	off_t insz;
+	uint8_t so;
 
 	assert(sizeof h == SECTORSZ);	/* must be padded & packed! */
 	assert(sizeof *m == SECTORSZ);	/* must be padded & packed! */
 
-	randomfn = streamfn = vmdkfn = NULL;
+	nbdfn = patchfn = randomfn = reffn = streamfn = vmdkfn = NULL;
 	capacity = 0;
+	grainsz = 0;
+	patchoff = -1;
+	optA = 0;
+	optC = 0;
+	optD = 0;
+	optM = 0;
+	optm = 0;
+	optP = 0;
 	opti = 0;
 	optt = 0;
+	optZ = 0;
 	zstrength = DEFLATE_STRENGTH;
+	threads = 0;
+	inflight = 0;
+	rate = 0;
+	interval = 0;
 	outspec = 0;
 
 	/* make getopt() in Linux more like BSD */
 	setenv("POSIXLY_CORRECT", "TRUE", 0);
 
-	while ((ch = getopt(argc, argv, ":c:dir:s:t:Vv:z:")) != -1) {
+	while ((ch = getopt(argc, argv, ":Aa:Cc:DdG:g:I:ij:Mmn:No:OPp:q:r:S:s:T:t:UVv:Zz:")) != -1) {
 		switch (ch) {
+		case 'A':
+			optA = 1;
+			break;
+		case 'a':
+			patchfn = optarg;
+			outspec |= 16;
+			break;
+		case 'C':
+			optC = 1;
+			outspec |= 32;
+			break;
 		case 'c':
 			if (expand_number(optarg, &capacity)) {
 				perror(optarg);
 				return usage();
 			}
 			break;
+		case 'D':
+			optD = 1;
+			break;
 		case 'd':
 			diag++;
 			break;
+		case 'G':
+			gtespergt = strtoul(optarg, &end, 0);
+			if (gtespergt < MIN_GTESPERGT ||
+			    gtespergt > MAX_GTESPERGT ||
+			    gtespergt & (gtespergt - 1) || *end)
+				return usage();
+			break;
+		case 'g':
+			if (expand_number(optarg, &grainsz)) {
+				perror(optarg);
+				return usage();
+			}
+			if (grainsz % SECTORSZ ||
+			    grainsz / SECTORSZ < (int64_t)MIN_GRAINSZ ||
+			    grainsz / SECTORSZ > (int64_t)MAX_GRAINSZ ||
+			    grainsz & (grainsz - 1))
+				return usage();
+			grainsecs = grainsz / SECTORSZ;
+			break;
+		case 'I':
+			reffn = optarg;
+			break;
 		case 'i':
 			opti = 1;
 			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 0);
+			if (threads < 1 || *end)
+				return usage();
+			break;
+		case 'M':
+			optM = 1;
+			break;
+		case 'm':
+			optm = 1;
+			break;
+		case 'n':
+			nbdfn = optarg;
+			outspec |= 8;
+			break;
+		case 'N':
+			cachemode |= CACHE_DROP;
+			break;
+		case 'o':
+			if (expand_number(optarg, &patchoff) || patchoff < 0) {
+				perror(optarg);
+				return usage();
+			}
+			break;
+		case 'O':
+			cachemode |= CACHE_DROP | CACHE_DIRECT;
+			break;
+		case 'P':
+			optP = 1;
+			break;
+		case 'p':
+			interval = strtoul(optarg, &end, 0);
+			if (!interval || *end)
+				return usage();
+			break;
+		case 'q':
+			inflight = strtoul(optarg, &end, 0);
+			if (!inflight || *end)
+				return usage();
+			break;
 		case 'r':
 			randomfn = optarg;
 			outspec |= 1;
 			break;
+		case 'S':
+			if (strcmp(optarg, "text") == 0)
+				statfmt = STATS_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				statfmt = STATS_JSON;
+			else
+				return usage();
+			break;
 		case 's':
 			streamfn = optarg;
 			outspec |= 2;
 			break;
+		case 'T':
+			rate = strtoul(optarg, &end, 0);
+			if (!rate || *end)
+				return usage();
+			break;
 		case 't':
 			optt = strtoul(optarg, &end, 0);
 			if (!optt || *end)
 				return usage();
 			break;
+		case 'U':
+			useuring = 1;
+			break;
 		case 'V':
 			printf("vmdktool version 1.4\n");
 			return 0;
@@ -853,6 +3693,9 @@ main(int argc, char **argv)
 			vmdkfn = optarg;
 			outspec |= 4;
 			break;
+		case 'Z':
+			optZ = 1;
+			break;
 		case 'z':
 			if (optarg[0] < '0' || optarg[0] > '9' || optarg[1])
 				return usage();
@@ -866,11 +3709,44 @@ main(int argc, char **argv)
 
 	if (argc - optind != 1)
 		return usage();
+	started = stattime();
+
+	zeroinit();
 
-	if ((capacity || zstrength != DEFLATE_STRENGTH) && !vmdkfn)
+	if (!threads)
+		threads = nbdfn ? NBD_THREADS : optC ? VERIFY_THREADS : 1;
+	if ((capacity || grainsz || gtespergt != SET_GTESPERGT || optZ ||
+	    optA || optD || optm || rate || reffn) && !vmdkfn)
 		return usage();
+	if (zstrength != DEFLATE_STRENGTH && !vmdkfn && !patchfn)
+		return usage();
+	if (patchoff != -1 && !patchfn)
+		return usage();
+	if (inflight && !vmdkfn && !nbdfn && !optC)
+		return usage();
+	if (optm && (zstrength != DEFLATE_STRENGTH || threads != 1 ||
+	    inflight || optA || optD || rate || reffn))
+		return usage();
+	if (threads != 1 && !vmdkfn && !randomfn && !nbdfn && !optC)
+		return usage();
+	if (interval && !vmdkfn && !randomfn && !streamfn && !optC)
+		return usage();
+	if (optM && !randomfn && !streamfn)
+		return usage();
+	if (optP && !randomfn)
+		return usage();
+	if (useuring && !vmdkfn && !randomfn && !streamfn)
+		return usage();
+	if (cachemode && !vmdkfn && !randomfn && !streamfn)
+		return usage();
+	cachegrains = inflight;
+	if (!inflight)
+		inflight = threads * INFLIGHT_PER_THREAD;
 
 	switch (outspec) {
+	case 32:
+	case 16:
+	case 8:
 	case 4:
 	case 2:
 	case 1:
@@ -878,13 +3754,25 @@ main(int argc, char **argv)
 	case 0:
 		if (opti)
 			break;
-		fprintf(stderr, "One of -i, -r, -s or -v must be used\n");
+		fprintf(stderr, "One of -a, -C, -i, -n, -r, -s or -v must be "
+		    "used\n");
 		return usage();
 	default:
-		fprintf(stderr, "Only one of -r, -s and -v may be used\n");
+		fprintf(stderr, "Only one of -a, -C, -n, -r, -s and -v may be "
+		    "used\n");
 		return usage();
 	}
 
+	ofd = -1;
+	if (vmdkfn && strcmp(vmdkfn, "-") == 0) {
+		/* stdout carries the VMDK, so diagnostics go to stderr */
+		if ((ofd = dup(STDOUT_FILENO)) == -1 ||
+		    dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+			perror("dup");
+			return 12;
+		}
+	}
+
 	if ((ifd = open(argv[optind], O_RDONLY)) == -1) {
 		perror(argv[optind]);
 		return 2;
@@ -911,7 +3799,7 @@ main(int argc, char **argv)
 		return 4;
 	}
 
-	if (randomfn || streamfn || opti || optt) {
+	if (nbdfn || optC || patchfn || randomfn || streamfn || opti || optt) {
 		if (insz < (ssize_t)(sizeof h + SECTORSZ)) {
 			fprintf(stderr, "%s: File too small "
 			    "(must be at least %d bytes)\n", argv[optind],
@@ -940,21 +3828,39 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (h.gdOffset + 1 == 0 && (randomfn || opti || optt)) {
+	if (h.gdOffset + 1 == 0 && (optC || randomfn || opti || optt)) {
 		/* Take a crack at finding the footer */
 		sec = (insz - sizeof h - SECTORSZ * 2) / SECTORSZ;
-		lseek(ifd, sec * SECTORSZ, SEEK_SET);
-		aread(ifd, block, SECTORSZ);
-		m = (struct Marker *)block;
-		if (m->size || m->u.type != MARKER_FOOTER) {
+		so = h.streamoptimized;
+		if (vmdkfooter(ifd, insz, &h) == -1) {
 			fprintf(stderr, "%s: Cannot find FOOTER at "
 			    "sector %llu\n", argv[optind],
 			    (unsigned long long)sec);
 			return 8;
 		}
-		assert(vmdkinfo(argv[optind], ifd, &h, 0));
+		h.streamoptimized = so;
+		if (diag) {
+			printf("Sparse Extent Header/Footer found at 0x%08llx\n",
+			    (unsigned long long)(sec + 1) * SECTORSZ);
+			vmdkshow(&h);
+		}
+		vmdkvrfy(&h, diag);
 	}
 
+	/* Plain -i doesn't need the map, and must work on damaged files */
+	needmap = optC || randomfn || optt || (opti && diag);
+	if (needmap && !loadgrainmap(ifd, &h, &map)) {
+		fprintf(stderr, "%s: Cannot read the grain map: %s\n",
+		    argv[optind], strerror(errno));
+		return 14;
+	}
+	if (optC || randomfn || streamfn) {
+		stats.grains = (h.capacity + h.grainSize - 1) / h.grainSize;
+		grainsecs = h.grainSize;	/* For progress reports */
+	}
+	if (optM)
+		mapinput(ifd, insz, MADV_SEQUENTIAL);
+
 	if (opti) {
 		vmdkshow(&h);
 		vmdkvrfy(&h, 1);
@@ -962,11 +3868,16 @@ main(int argc, char **argv)
 		vmdkdescshow(dbuf);
 		free(dbuf);
 		if (diag)
-			vmdkshowtable(ifd, h.gdOffset, MARKER_GD, &h);
+			vmdkshowtable(ifd, h.gdOffset, MARKER_GD, &h, &map);
 	}
 
 	if (optt)
-		vmdkshowtable(ifd, optt, MARKER_GT, &h);
+		vmdkshowtable(ifd, optt, MARKER_GT, &h, &map);
+
+	if (optC || randomfn || streamfn || vmdkfn) {
+		progressstart(&pg, interval, vmdkfn != NULL);
+		cacheinit(ifd, argv[optind], 0, 1);
+	}
 
 	if (randomfn) {
 		ofd = open(randomfn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
@@ -974,12 +3885,33 @@ main(int argc, char **argv)
 			perror(randomfn);
 			return 9;
 		}
-		allgrains2raw(ifd, &h, ofd);
+		cacheinit(ofd, randomfn, 1, 0);
+		sparseout = isregular(ofd);
+		if (optP)
+			preallocate(ofd, &h, &map);
+		allgrains2raw(ifd, &h, &map, ofd, threads);
 		setsize(ofd, h.capacity);
+		cacheend(ofd);
 		if (close(ofd) == -1)
 			perror("close");
 	}
 
+	bad = 0;
+	if (optC) {
+		bad = verifyall(ifd, insz, &h, &map, threads, inflight, digest);
+		if (bad)
+			fprintf(stderr, "%s: %llu bad grains\n", argv[optind],
+			    (unsigned long long)bad);
+		else {
+			for (n = 0; n < SHA256_LEN; n++)
+				sprintf(hex + n * 2, "%02x", digest[n]);
+			printf("SHA256 (%s) = %s\n", argv[optind], hex);
+		}
+	}
+
+	if (needmap)
+		vmdkfreemap(&map);
+
 	if (streamfn) {
 		if (!h.streamoptimized) {
 			fprintf(stderr, "This file is not stream-optimized\n");
@@ -1005,24 +3937,127 @@ main(int argc, char **argv)
 				perror(streamfn);
 				return 11;
 			}
+			cacheinit(ofd, streamfn, 1, 0);
+			sparseout = isregular(ofd);
 		}
 		lseek(ifd, h.overHead * SECTORSZ, SEEK_SET);
 		vmdkparsestream(ifd, &h, ofd);
 		setsize(ofd, h.capacity);
+		cacheend(ofd);
 		if (ofd != -1 && close(ofd) == -1)
 			perror("close");
 	}
+	unmapinput();
+
+	if (nbdfn) {
+		if ((v = vmdkopen(argv[optind], cachegrains)) == NULL) {
+			fprintf(stderr, "%s: %s\n", argv[optind],
+			    strerror(errno));
+			return 15;
+		}
+		if (diag)
+			printf("Serving %s on %s with %d threads\n",
+			    argv[optind], nbdfn, threads);
+		if (nbdserve(v, nbdfn, threads, &stats.nbd) == -1) {
+			perror(nbdfn);
+			return 16;
+		}
+		vmdkclose(v);
+	}
+
+	if (patchfn) {
+		pfd = STDIN_FILENO;
+		if (strcmp(patchfn, "-") &&
+		    (pfd = open(patchfn, O_RDONLY)) == -1) {
+			perror(patchfn);
+			return 18;
+		}
+		if (vmdkpatch(argv[optind], pfd, patchoff == -1 ? 0 : patchoff,
+		    zstrength) == -1)
+			return 18;
+		if (pfd != STDIN_FILENO)
+			close(pfd);
+	}
+
+	if (reffn) {
+		if (strcmp(vmdkfn, "-") && stat(vmdkfn, &st) == 0 &&
+		    stat(reffn, &rst) == 0 && st.st_dev == rst.st_dev &&
+		    st.st_ino == rst.st_ino) {
+			fprintf(stderr, "%s: The reference can't be the "
+			    "output\n", reffn);
+			return 17;
+		}
+		if ((ref = vmdkopen(reffn, 0)) == NULL) {
+			fprintf(stderr, "%s: %s\n", reffn, strerror(errno));
+			return 17;
+		}
+		if (vmdkheader(ref)->grainSize != grainsecs ||
+		    !(vmdkheader(ref)->flags & FLAGBIT_COMPRESSED) ||
+		    vmdkheader(ref)->compressAlgorithm != COMPRESSION_DEFLATE) {
+			fprintf(stderr, "%s: Grains must be deflated and "
+			    "%lu sectors\n", reffn, (unsigned long)grainsecs);
+			return 17;
+		}
+	}
 
 	if (vmdkfn) {
-		ofd = open(vmdkfn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
-		if (ofd == -1) {
-			perror(vmdkfn);
+		memset(&wo, '\0', sizeof wo);
+		wo.capacity = capacity;
+		if (ofd != -1 && optm) {
+			fprintf(stderr, "-m can't write to stdout\n");
 			return 12;
+		} else if (optm && !capacity && insz == -1) {
+			fprintf(stderr, "%s: -c is required with -m for "
+			    "a device\n", argv[optind]);
+			return 13;
 		}
-		allraw2grains(ifd, capacity, ofd, zstrength);
+		if (optm && !capacity)
+			wo.capacity = insz;
+		if (ofd != -1) {
+			/* The header goes first, so capacity must be known */
+			if (!capacity && insz == -1) {
+				fprintf(stderr, "%s: -c is required to stream "
+				    "a device\n", argv[optind]);
+				return 13;
+			}
+			if (!capacity)
+				wo.capacity = insz;
+			wo.stream = 1;
+		} else if ((ofd = open(vmdkfn, O_WRONLY|O_CREAT|O_TRUNC,
+		    0644)) == -1) {
+			perror(vmdkfn);
+			return 12;
+		} else
+			cacheinit(ofd, vmdkfn, 1, 0);
+		wo.zstrength = zstrength;
+		wo.threads = threads;
+		wo.inflight = inflight;
+		wo.zggte = optZ;
+		wo.adaptive = optA;
+		wo.dedup = optD;
+		wo.rate = rate;
+		wo.sparse = optm;
+		wo.extent = (p = strrchr(vmdkfn, '/')) ? p + 1 : vmdkfn;
+		if (wo.sparse)
+			allraw2sparse(ifd, ofd, &wo);
+		else
+			allraw2grains(ifd, ofd, &wo);
+		cacheend(ofd);
 		if (close(ofd) == -1)
 			perror("close");
+		if (ref)
+			vmdkclose(ref);
 	}
 
-	return 0;
+	if (optC || randomfn || streamfn || vmdkfn) {
+		progressend(&pg);
+		cacheend(ifd);
+	}
+
+	if (diag > 1)
+		printf("%lu grain buffer and zlib allocations\n", nallocs);
+	if (statfmt)
+		statreport(started);
+
+	return bad ? 19 : 0;
 }